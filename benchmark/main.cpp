@@ -0,0 +1,1175 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSysInfo>
+#include <QTextStream>
+
+#include "../ellipsoid/renderer.h"
+
+struct Resolution {
+    uint width;
+    uint height;
+};
+
+constexpr Resolution RESOLUTIONS[] = {
+    {640, 480},
+    {1280, 720},
+    {1920, 1080},
+    {3840, 2160},
+};
+constexpr uint GRANULARITIES[] = {1, 2, 4, 8, 16};
+
+/// Kernel timings and thread scaling use this one instead of the whole matrix.
+constexpr Resolution REFERENCE_RESOLUTION = {1920, 1080};
+
+/// Scanline coefficients are checked at frames this wide, with the aspect
+/// ratio of REFERENCE_RESOLUTION.
+constexpr uint ACCURACY_WIDTHS[] = {3840, 15360, 61440};
+constexpr uint ACCURACY_ROWS    = 64;
+/// Walked coefficients may be off by this much, in float ulps of the largest
+/// term of their polynomial.
+constexpr double ACCURACY_MAX_ULPS = 1;
+
+/// Packet kernels may shade this many colour levels off the scalar one, as
+/// Renderer::castRays promises.
+constexpr float PACKET_MAX_LEVELS = 1;
+
+/// Camera rotation between the frames of the reprojection measurements, what
+/// a 5 pixel drag turns it by.
+constexpr float REPROJECTION_STEP = PI_F * 5 / 1000;
+/// Reprojected pixels off from traced ones by more than this many colour
+/// levels are reported.
+constexpr int REPROJECTION_TOLERANCE = 16;
+
+/// Specular exponents the specular power table is checked at.
+constexpr float SPECULAR_FOCI[] = {2.f, 10.f, 50.f, 250.f};
+
+/// Samples per pixel the supersampling benchmark averages, the default
+/// budget of the interactive view.
+constexpr uint SUPERSAMPLES = 16;
+/// Side of the grid of samples per pixel its reference is averaged from.
+constexpr uint SUPERSAMPLE_REFERENCE_GRID = 16;
+
+/// Sizes of the instance lattices the hierarchy is measured on.
+constexpr uint INSTANCE_COUNTS[] = {1, 100, 10000};
+/// Single-instance moves the refit time is averaged over.
+constexpr uint INSTANCE_MOVES = 1000;
+
+struct Scenario {
+    const char *name;
+    Params      params;
+};
+
+static QList<Scenario> scenarios() {
+    QList<Scenario> res;
+
+    auto params = DEFAULT_PARAMS;
+    res.append({"default", params});
+
+    params       = DEFAULT_PARAMS;
+    params.scale = 0.1f;
+    res.append({"small", params});
+
+    // Fills the whole screen
+    params                = DEFAULT_PARAMS;
+    params.cameraDistance = 2.f;
+    res.append({"large", params});
+
+    params           = DEFAULT_PARAMS;
+    params.positionX = 40.f;
+    res.append({"offscreen", params});
+
+    params          = DEFAULT_PARAMS;
+    params.stretchX = 8.f;
+    params.stretchY = 8.f;
+    params.stretchZ = 0.02f;
+    res.append({"disc", params});
+
+    params          = DEFAULT_PARAMS;
+    params.stretchX = 9.f;
+    params.stretchY = 0.02f;
+    params.stretchZ = 0.02f;
+    res.append({"needle", params});
+
+    return res;
+}
+
+/// Scenes whose discriminant nearly cancels over much of the frame, only
+/// measured for the precision of the solver.
+static QList<Scenario> extremeScenarios() {
+    QList<Scenario> res;
+
+    // Just in front of the far plane
+    auto params           = DEFAULT_PARAMS;
+    params.cameraDistance = 19.f;
+    res.append({"distant", params});
+
+    params          = DEFAULT_PARAMS;
+    params.scale    = 0.004f;
+    params.stretchX = 1000.f;
+    params.stretchY = 1.f;
+    params.stretchZ = 0.001f;
+    res.append({"sliver", params});
+
+    return res;
+}
+
+/// Tile orders of the traversal measurements, with their JSON names.
+constexpr std::pair<TileOrder, const char *> TILE_ORDERS[] = {
+    {TileOrder::RowMajor, "rowMajor"},
+    {TileOrder::Morton, "morton"},
+    {TileOrder::Hilbert, "hilbert"},
+};
+
+/// Solver precisions, with their JSON names.
+constexpr std::pair<Renderer::Precision, const char *> PRECISIONS[] = {
+    {Renderer::Precision::Single, "single"},
+    {Renderer::Precision::Double, "double"},
+    {Renderer::Precision::Mixed, "mixed"},
+};
+
+/// Hardware cache misses in user space of every thread that attached itself,
+/// as far as the kernel lets an unprivileged process count them.
+class CacheMisses {
+public:
+    CacheMisses() : m_mutex{}, m_counters{} {}
+    ~CacheMisses() {
+#ifdef __linux__
+        for (const auto fd : m_counters)
+            if (fd >= 0)
+                close(fd);
+#endif
+    }
+
+    /// Counts the calling thread from now on, repeated calls do nothing.
+    void attach() {
+        QMutexLocker lock{&m_mutex};
+        const auto   thread = QThread::currentThreadId();
+        if (m_counters.contains(thread))
+            return;
+
+        int fd = -1;
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.size           = sizeof(attr);
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+        m_counters.insert(thread, fd);
+    }
+
+    void reset() {
+#ifdef __linux__
+        QMutexLocker lock{&m_mutex};
+        for (const auto fd : m_counters)
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+#endif
+    }
+
+    /// Sum over the attached threads, -1 if none of them could be counted.
+    qint64 read() {
+        qint64 res = -1;
+#ifdef __linux__
+        QMutexLocker lock{&m_mutex};
+        for (const auto fd : m_counters) {
+            quint64 count;
+            if (fd >= 0 && ::read(fd, &count, sizeof(count)) == sizeof(count))
+                res = qMax(res, 0ll) + count;
+        }
+#endif
+        return res;
+    }
+
+private:
+    QMutex                 m_mutex;
+    QHash<Qt::HANDLE, int> m_counters;
+};
+
+static qint64 median(QList<qint64> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+/// Times whole passes of a Renderer and, through its public kernel entry
+/// points, the per-pixel kernels and single tiles without the culling and
+/// pixel writes around them. Also checks the packet kernel and the solver
+/// precisions against the scalar and double references.
+class RendererBenchmark {
+public:
+    RendererBenchmark(uint repeat)
+        : m_repeat{repeat}, m_stats{}, m_cacheMisses{} {
+        // Measurements render the same params over and over, which must be
+        // traced every time
+        m_renderer.setFrameCacheBudget(0);
+        QObject::connect(
+            &m_renderer, &Renderer::renderCompleted, &m_renderer,
+            [this](const RenderStats &stats) { m_stats = stats; },
+            Qt::DirectConnection
+        );
+    }
+
+    /// Every pixel centre of the frame, no matter the silhouette, with b and c
+    /// walked along each scanline as in the renderer.
+    QJsonObject kernel(const Scenario &scenario, Renderer::Kernel kernel) {
+        auto params = scenario.params;
+        prepare(params);
+
+        const auto w = params.width;
+        const auto h = params.height;
+
+        QList<qint64> times;
+        quint64       hits = 0;
+        for (uint i = 0; i < m_repeat; i++) {
+            hits = 0;
+            QElapsedTimer timer;
+            timer.start();
+            for (uint y = 0; y < h; y++) {
+                const auto ndcY = (y * 2.f + 1) / h - 1;
+                const ScanlineCoefficients scanline{
+                    m_renderer.coefficients(), ndcY
+                };
+                ScanlineWalker walker{scanline, 1. / w - 1, 2. / w};
+
+                if (kernel == Renderer::Kernel::Scalar) {
+                    for (uint x = 0; x < w; x++, walker.advance()) {
+                        const auto ndcX = (x * 2.f + 1) / w - 1;
+                        const auto sample = m_renderer.castRay(
+                            ndcX, ndcY, walker.b, walker.c
+                        );
+                        hits += sample.hit;
+                    }
+                    continue;
+                }
+                alignas(32) float bs[PPacket::WIDTH];
+                alignas(32) float cs[PPacket::WIDTH];
+                SurfaceSample     samples[PPacket::WIDTH];
+                for (uint x = 0; x + PPacket::WIDTH <= w; x += PPacket::WIDTH) {
+                    for (uint l = 0; l < PPacket::WIDTH; l++) {
+                        bs[l] = walker.b;
+                        cs[l] = walker.c;
+                        walker.advance();
+                    }
+                    const auto ndcX = (x * 2.f + 1) / w - 1;
+                    m_renderer.castRays(
+                        PPacket::ramp(ndcX, 2.f / w), ndcY, PPacket::load(bs),
+                        PPacket::load(cs), samples
+                    );
+                    for (const auto &sample : samples)
+                        hits += sample.hit;
+                }
+            }
+            times.append(timer.nsecsElapsed());
+        }
+
+        const auto rays = kernel == Renderer::Kernel::Scalar
+                            ? (quint64)w * h
+                            : (quint64)w / PPacket::WIDTH * PPacket::WIDTH * h;
+
+        const auto name =
+            kernel == Renderer::Kernel::Scalar ? "scalar" : "packet";
+
+        QJsonObject res;
+        res["scenario"]    = scenario.name;
+        res["kernel"]      = name;
+        res["rays"]        = (qint64)rays;
+        res["hitFraction"] = (double)hits / rays;
+        res["nsPerRay"]    = (double)median(times) / rays;
+        return res;
+    }
+
+    /// Every pixel centre of the frame shaded from both kernels, with the
+    /// largest difference in colour levels and the rays they disagree on
+    /// hitting.
+    QJsonObject packetAccuracy(const Scenario &scenario) {
+        auto params = scenario.params;
+        prepare(params);
+
+        const auto w = params.width;
+        const auto h = params.height;
+
+        const auto shade = [this, &params](const SurfaceSample &sample) {
+            return m_renderer.lightIntensity(
+                sample, params.lightAmbient, params.lightDiffuse,
+                params.lightSpecular, params.lightSpecularFocus
+            );
+        };
+
+        float   levelsOff = 0;
+        quint64 hitsOff   = 0;
+        quint64 rays      = 0;
+        for (uint y = 0; y < h; y++) {
+            const auto ndcY = (y * 2.f + 1) / h - 1;
+            const ScanlineCoefficients scanline{
+                m_renderer.coefficients(), ndcY
+            };
+            ScanlineWalker walker{scanline, 1. / w - 1, 2. / w};
+
+            alignas(32) float ndcXs[PPacket::WIDTH];
+            alignas(32) float bs[PPacket::WIDTH];
+            alignas(32) float cs[PPacket::WIDTH];
+            SurfaceSample     samples[PPacket::WIDTH];
+            for (uint x = 0; x + PPacket::WIDTH <= w; x += PPacket::WIDTH) {
+                for (uint l = 0; l < PPacket::WIDTH; l++) {
+                    ndcXs[l] = ((x + l) * 2.f + 1) / w - 1;
+                    bs[l]    = walker.b;
+                    cs[l]    = walker.c;
+                    walker.advance();
+                }
+                m_renderer.castRays(
+                    PPacket::load(ndcXs), ndcY, PPacket::load(bs),
+                    PPacket::load(cs), samples
+                );
+                for (uint l = 0; l < PPacket::WIDTH; l++) {
+                    const auto reference =
+                        m_renderer.castRay(ndcXs[l], ndcY, bs[l], cs[l]);
+                    const auto difference =
+                        std::abs(shade(samples[l]) - shade(reference));
+                    levelsOff  = qMax(levelsOff, difference * 255);
+                    hitsOff   += samples[l].hit != reference.hit;
+                }
+                rays += PPacket::WIDTH;
+            }
+        }
+
+        QJsonObject res;
+        res["scenario"]    = scenario.name;
+        res["packetWidth"] = (int)PPacket::WIDTH;
+        res["rays"]        = (qint64)rays;
+        res["levelsOff"]   = levelsOff;
+        res["hitsOff"]     = (qint64)hitsOff;
+        return res;
+    }
+
+    /// Full pipeline of a single pass traced from scratch.
+    QJsonObject frame(
+        const Scenario &scenario, Resolution resolution, uint granularity
+    ) {
+        auto params             = scenario.params;
+        params.width            = resolution.width;
+        params.height           = resolution.height;
+        params.pixelGranularity = granularity;
+        m_renderer.frames().resize(params.width, params.height);
+
+        // Pixel writes are summed over the worker threads
+        QList<qint64> times, writeTimes;
+        for (uint i = 0; i < m_repeat; i++) {
+            m_renderer.forgetLastPass();
+            QElapsedTimer timer;
+            timer.start();
+            m_renderer.renderEllipsoid(params, 0);
+            times.append(timer.nsecsElapsed());
+            writeTimes.append(m_stats.pixelWriteNs);
+        }
+        const auto frameNs = median(times);
+        const auto writeNs = median(writeTimes);
+
+        QJsonObject res;
+        res["scenario"]        = scenario.name;
+        res["width"]           = (int)params.width;
+        res["height"]          = (int)params.height;
+        res["granularity"]     = (int)granularity;
+        res["threads"]         = (int)m_renderer.threadCount();
+        res["frameNs"]         = frameNs;
+        res["raysTraced"]      = (qint64)m_stats.raysTraced;
+        res["raysHit"]         = (qint64)m_stats.raysHit;
+        res["raysCulled"]      = (qint64)m_stats.raysCulled;
+        res["pixelsWritten"]   = (qint64)m_stats.pixelsWritten;
+        res["nsPerRay"]        = m_stats.raysTraced == 0
+                                   ? 0.
+                                   : (double)frameNs / m_stats.raysTraced;
+        res["pixelWriteNs"]    = writeNs;
+        res["nsPerPixelWrite"] = m_stats.pixelsWritten == 0
+                                   ? 0.
+                                   : (double)writeNs / m_stats.pixelsWritten;
+        return res;
+    }
+
+    /// A frame at REFERENCE_RESOLUTION warped into a view orbited by
+    /// REPROJECTION_STEP, timed against tracing that view, and how far the
+    /// warped pixels are off.
+    QJsonObject reprojection(const Scenario &scenario) {
+        auto params             = scenario.params;
+        params.width            = REFERENCE_RESOLUTION.width;
+        params.height           = REFERENCE_RESOLUTION.height;
+        params.pixelGranularity = 1;
+        m_renderer.frames().resize(params.width, params.height);
+
+        auto orbited          = params;
+        orbited.cameraAngleX += REPROJECTION_STEP;
+        orbited.cameraAngleY += REPROJECTION_STEP;
+
+        QList<qint64> tracedTimes;
+        for (uint i = 0; i < m_repeat; i++) {
+            m_renderer.forgetLastPass();
+            QElapsedTimer timer;
+            timer.start();
+            m_renderer.renderEllipsoid(orbited, 0);
+            tracedTimes.append(timer.nsecsElapsed());
+        }
+        m_renderer.frames().swap();
+        const auto traced = copyFront();
+
+        // Anything coarser than single pixels gets reprojected
+        orbited.pixelGranularity = 2;
+        QList<qint64> times;
+        for (uint i = 0; i < m_repeat; i++) {
+            m_renderer.forgetLastPass();
+            m_renderer.renderEllipsoid(params, 0);
+            m_renderer.frames().swap();
+
+            QElapsedTimer timer;
+            timer.start();
+            m_renderer.renderEllipsoid(orbited, 0);
+            times.append(timer.nsecsElapsed());
+        }
+        m_renderer.frames().swap();
+        const auto reprojected = copyFront();
+
+        quint64 pixelsOff = 0;
+        for (qsizetype i = 0; i < traced.size(); i += COLOR_CHANNELS) {
+            for (uint channel = 0; channel < 3; channel++) {
+                const auto difference = (uchar)traced[i + channel]
+                                      - (uchar)reprojected[i + channel];
+                if (qAbs(difference) > REPROJECTION_TOLERANCE) {
+                    pixelsOff++;
+                    break;
+                }
+            }
+        }
+
+        QJsonObject res;
+        res["scenario"]        = scenario.name;
+        res["frameNs"]         = median(times);
+        res["tracedFrameNs"]   = median(tracedTimes);
+        res["raysReprojected"] = (qint64)m_stats.raysReprojected;
+        res["raysTraced"]      = (qint64)m_stats.raysTraced;
+        res["pixelsOff"]       = (qint64)pixelsOff;
+        return res;
+    }
+
+    /// Orbits back and forth between two views at REFERENCE_RESOLUTION, every
+    /// visit but the first to each coming from the frame cache.
+    QJsonObject frameCache(const Scenario &scenario) {
+        auto params             = scenario.params;
+        params.width            = REFERENCE_RESOLUTION.width;
+        params.height           = REFERENCE_RESOLUTION.height;
+        params.pixelGranularity = 1;
+        m_renderer.frames().resize(params.width, params.height);
+        m_renderer.forgetLastPass();
+        m_renderer.setFrameCacheBudget(DEFAULT_FRAME_CACHE_BYTES);
+
+        auto orbited          = params;
+        orbited.cameraAngleY += REPROJECTION_STEP;
+
+        const auto   &cache  = m_renderer.frameCache();
+        const auto    hits   = cache.hits();
+        const auto    misses = cache.misses();
+        QList<qint64> tracedTimes, times;
+        for (uint i = 0; i < m_repeat + 1; i++) {
+            for (const auto &view : {params, orbited}) {
+                QElapsedTimer timer;
+                timer.start();
+                m_renderer.renderEllipsoid(view, 0);
+                (i == 0 ? tracedTimes : times).append(timer.nsecsElapsed());
+                m_renderer.frames().swap();
+            }
+        }
+
+        QJsonObject res;
+        res["scenario"]      = scenario.name;
+        res["frameNs"]       = median(times);
+        res["tracedFrameNs"] = median(tracedTimes);
+        res["hits"]          = (qint64)(cache.hits() - hits);
+        res["misses"]        = (qint64)(cache.misses() - misses);
+        res["cachedBytes"]   = cache.size();
+
+        m_renderer.setFrameCacheBudget(0);
+        return res;
+    }
+
+    /// Supersampling passes at REFERENCE_RESOLUTION up to SUPERSAMPLES, the
+    /// first of which also looks for the edges. 'levelsBefore' and
+    /// 'levelsAfter' are the mean colour differences of the pixels it refines
+    /// that the silhouette crosses, against a dense grid of samples per pixel.
+    QJsonObject supersample(const Scenario &scenario) {
+        auto params             = scenario.params;
+        params.width            = REFERENCE_RESOLUTION.width;
+        params.height           = REFERENCE_RESOLUTION.height;
+        params.pixelGranularity = 1;
+        m_renderer.frames().resize(params.width, params.height);
+
+        QList<qint64> firstTimes, times;
+        QByteArray    traced;
+        for (uint i = 0; i < m_repeat; i++) {
+            m_renderer.forgetLastPass();
+            m_renderer.renderEllipsoid(params, 0);
+            m_renderer.frames().swap();
+            traced = copyFront();
+            for (uint samples = 2; samples <= SUPERSAMPLES; samples++) {
+                m_renderer.supersample(params, 0);
+                m_renderer.frames().swap();
+                (samples == 2 ? firstTimes : times).append(m_stats.durationNs);
+            }
+        }
+        const auto supersampled = copyFront();
+
+        const auto  grid       = SUPERSAMPLE_REFERENCE_GRID;
+        const uchar material[] = {
+            params.materialRed, params.materialGreen, params.materialBlue
+        };
+        double  levelsBefore = 0;
+        double  levelsAfter  = 0;
+        quint64 crossed      = 0;
+        for (uint y = 0; y < params.height; y++) {
+            const auto sums = m_renderer.accumulation().constRow(y);
+            for (uint x = 0; x < params.width; x++) {
+                if (sums[x] < 0)
+                    continue;
+                double intensity = 0;
+                uint   hits      = 0;
+                for (uint i = 0; i < grid * grid; i++) {
+                    const auto ndcX =
+                        ((x + (i % grid + 0.5f) / grid) * 2) / params.width - 1;
+                    const auto ndcY =
+                        ((y + (i / grid + 0.5f) / grid) * 2) / params.height
+                        - 1;
+                    const auto sample = m_renderer.castRay(ndcX, ndcY);
+                    const auto shade  = m_renderer.lightIntensity(
+                        sample, params.lightAmbient, params.lightDiffuse,
+                        params.lightSpecular, params.lightSpecularFocus
+                    );
+                    hits      += sample.hit;
+                    intensity += shade;
+                }
+                if (hits == 0 || hits == grid * grid)
+                    continue;
+                crossed++;
+                intensity /= grid * grid;
+
+                const auto pixel = ((qsizetype)y * params.width + x)
+                                 * COLOR_CHANNELS;
+                for (uint c = 0; c < 3; c++) {
+                    const auto reference = material[c] * intensity;
+                    levelsBefore +=
+                        std::abs((uchar)traced[pixel + c] - reference);
+                    levelsAfter +=
+                        std::abs((uchar)supersampled[pixel + c] - reference);
+                }
+            }
+        }
+
+        QJsonObject res;
+        res["scenario"]     = scenario.name;
+        res["samples"]      = (int)SUPERSAMPLES;
+        res["edgePixels"]   = (qint64)m_stats.raysTraced;
+        res["firstPassNs"]  = median(firstTimes);
+        res["passNs"]       = median(times);
+        res["levelsBefore"] = crossed > 0 ? levelsBefore / (3 * crossed) : 0;
+        res["levelsAfter"]  = crossed > 0 ? levelsAfter / (3 * crossed) : 0;
+        return res;
+    }
+
+    /// Builds of the hierarchy over instanceLattice(count), refits after
+    /// moving a single instance, and a full-resolution frame of them at
+    /// REFERENCE_RESOLUTION. The cost per ray follows the depth of the tree
+    /// rather than the number of instances.
+    QJsonObject instances(uint count) {
+        auto params             = DEFAULT_PARAMS;
+        params.width            = REFERENCE_RESOLUTION.width;
+        params.height           = REFERENCE_RESOLUTION.height;
+        params.pixelGranularity = 1;
+        m_renderer.frames().resize(params.width, params.height);
+
+        const auto    lattice = instanceLattice(count);
+        QList<qint64> buildTimes;
+        for (uint i = 0; i < m_repeat; i++) {
+            QElapsedTimer timer;
+            timer.start();
+            m_renderer.setInstances(lattice);
+            buildTimes.append(timer.nsecsElapsed());
+        }
+
+        // Every move is undone by the next one, which leaves the tree as
+        // tight as it was built
+        const auto    nudge = PMat4::translation(0.01f, 0, 0);
+        QElapsedTimer timer;
+        timer.start();
+        for (uint i = 0; i < INSTANCE_MOVES; i++) {
+            const auto index = i / 2 * 7919 % count;
+            m_renderer.moveInstance(
+                index, i % 2 == 0 ? Instance{nudge * lattice[index].model}
+                                  : lattice[index]
+            );
+        }
+        const auto refitNs = timer.nsecsElapsed() / INSTANCE_MOVES;
+
+        QList<qint64> times;
+        for (uint i = 0; i < m_repeat; i++) {
+            m_renderer.forgetLastPass();
+            timer.start();
+            m_renderer.renderEllipsoid(params, 0);
+            times.append(timer.nsecsElapsed());
+        }
+        const auto frameNs = median(times);
+
+        const auto &bvh = m_renderer.instances();
+
+        QJsonObject res;
+        res["instances"]   = (int)count;
+        res["nodes"]       = (int)bvh.nodeCount();
+        res["depth"]       = (int)bvh.depth();
+        res["buildNs"]     = median(buildTimes);
+        res["refitNs"]     = refitNs;
+        res["frameNs"]     = frameNs;
+        res["raysTraced"]  = (qint64)m_stats.raysTraced;
+        res["raysCulled"]  = (qint64)m_stats.raysCulled;
+        res["hitFraction"] = m_stats.hitFraction();
+        res["nsPerRay"]    = m_stats.raysTraced == 0
+                               ? 0.
+                               : (double)frameNs / m_stats.raysTraced;
+
+        m_renderer.setInstances({});
+        return res;
+    }
+
+    /// Shade-only passes at REFERENCE_RESOLUTION with powf against the
+    /// specular table, along with the error of the table and the largest
+    /// colour difference it makes in the frame.
+    QJsonObject specular(const Scenario &scenario, float focus) {
+        auto params               = scenario.params;
+        params.width              = REFERENCE_RESOLUTION.width;
+        params.height             = REFERENCE_RESOLUTION.height;
+        params.pixelGranularity   = 1;
+        params.lightSpecularFocus = focus;
+        m_renderer.frames().resize(params.width, params.height);
+
+        // Changing the ambient term alone keeps the geometry for reshading
+        auto shaded          = params;
+        shaded.lightAmbient += 0.01f;
+
+        QJsonObject res;
+        res["scenario"] = scenario.name;
+        res["focus"]    = focus;
+
+        const auto previousMode = m_renderer.specular();
+        QByteArray frames[2];
+        for (const auto mode :
+             {Renderer::Specular::Exact, Renderer::Specular::Table}) {
+            m_renderer.setSpecular(mode);
+            m_renderer.forgetLastPass();
+            m_renderer.renderEllipsoid(params, 0);
+
+            QList<qint64> times;
+            for (uint i = 0; i < m_repeat; i++) {
+                QElapsedTimer timer;
+                timer.start();
+                m_renderer.renderEllipsoid(i % 2 == 0 ? shaded : params, 0);
+                times.append(timer.nsecsElapsed());
+            }
+            m_renderer.renderEllipsoid(shaded, 0);
+            m_renderer.frames().swap();
+
+            const auto table = mode == Renderer::Specular::Table;
+            frames[table]    = copyFront();
+            res[table ? "tableShadeNs" : "exactShadeNs"] = median(times);
+        }
+
+        int levelsOff = 0;
+        for (qsizetype i = 0; i < frames[0].size(); i++) {
+            const auto difference = (uchar)frames[0][i] - (uchar)frames[1][i];
+            levelsOff             = qMax(levelsOff, qAbs(difference));
+        }
+        res["tableError"] = m_renderer.specularTableError();
+        res["levelsOff"]  = levelsOff;
+        m_renderer.setSpecular(previousMode);
+        return res;
+    }
+
+    /// Passes traced from scratch at REFERENCE_RESOLUTION, dispatched like
+    /// renderEllipsoid does but timing every tile. 'halfSilhouetteNs' is when
+    /// the tiles done so far hold half of the traced rays, i.e. when a
+    /// display fed tile by tile would show half of the ellipsoid.
+    QJsonObject tileOrder(const Scenario &scenario, TileOrder order) {
+        auto params             = scenario.params;
+        params.width            = REFERENCE_RESOLUTION.width;
+        params.height           = REFERENCE_RESOLUTION.height;
+        params.pixelGranularity = 1;
+        m_renderer.frames().resize(params.width, params.height);
+
+        const auto previousOrder = m_renderer.tileOrder();
+        m_renderer.setTileOrder(order);
+        // Sets up the matrices and the surface buffer
+        m_renderer.forgetLastPass();
+        m_renderer.renderEllipsoid(params, 0);
+        const auto tiles =
+            m_renderer.passTiles(params.width, params.height, 1);
+
+        QList<qint64> times, halfTimes, misses;
+        for (uint i = 0; i < m_repeat; i++) {
+            QMutex                            mutex;
+            QList<std::pair<qint64, quint64>> done;
+
+            m_cacheMisses.reset();
+            QElapsedTimer timer;
+            timer.start();
+            m_renderer.traceTiles(
+                tiles, params, [&] { m_cacheMisses.attach(); },
+                [&](quint64 raysTraced) {
+                    QMutexLocker lock{&mutex};
+                    done.append({timer.nsecsElapsed(), raysTraced});
+                }
+            );
+            times.append(timer.nsecsElapsed());
+            misses.append(m_cacheMisses.read());
+
+            std::sort(done.begin(), done.end());
+            quint64 rays = 0;
+            for (const auto &[ns, tileRays] : done)
+                rays += tileRays;
+            quint64 raysDone = 0;
+            for (const auto &[ns, tileRays] : done) {
+                raysDone += tileRays;
+                if (2 * raysDone >= rays) {
+                    halfTimes.append(ns);
+                    break;
+                }
+            }
+        }
+        m_renderer.setTileOrder(previousOrder);
+
+        QJsonObject res;
+        res["scenario"]         = scenario.name;
+        res["tiles"]            = (int)tiles.size();
+        res["frameNs"]          = median(times);
+        res["halfSilhouetteNs"] = median(halfTimes);
+        res["cacheMisses"]      = median(misses) < 0 ? QJsonValue{}
+                                                     : median(misses);
+        return res;
+    }
+
+    /// Errors of b and c against exact values, in float ulps of the largest
+    /// term of their polynomial, for ScanlineWalker restarted at every tile
+    /// like the renderer does, for ScanlineWalker across whole scanlines and
+    /// for the direct float formula. 'wrongSign' counts the samples whose
+    /// float discriminant disagrees with the exact one on hit or miss.
+    QJsonArray accuracy(const Scenario &scenario, uint width) {
+        // The coefficients only depend on the aspect ratio, a frame this large
+        // would not fit in memory
+        auto params = scenario.params;
+        prepare(params);
+
+        const auto  w = width;
+        const auto  h = width / REFERENCE_RESOLUTION.width
+                     * REFERENCE_RESOLUTION.height;
+        const auto  tileWidth = m_renderer.tileWidth();
+        const auto &q         = m_renderer.coefficients();
+
+        struct Error {
+            const char *walk;
+            double      b         = 0;
+            double      c         = 0;
+            quint64     wrongSign = 0;
+        };
+        Error tiled{"tile"}, whole{"scanline"}, direct{"direct"};
+
+        for (uint i = 0; i < ACCURACY_ROWS; i++) {
+            const auto y    = (h - 1) * i / (ACCURACY_ROWS - 1);
+            const auto ndcY = (y * 2.f + 1) / h - 1;
+
+            const ScanlineCoefficients scanline{q, ndcY};
+            const auto                &s = scanline;
+
+            ScanlineWalker rowWalker{s, 1. / w - 1, 2. / w};
+            ScanlineWalker tileWalker = rowWalker;
+            for (uint x = 0; x < w; x++) {
+                const auto ndcX = (x * 2. + 1) / w - 1;
+                if (x % tileWidth == 0)
+                    tileWalker = ScanlineWalker{s, ndcX, 2. / w};
+
+                const auto exactB = s.b1 * ndcX + s.b0;
+                const auto exactC = (s.c2 * ndcX + s.c1) * ndcX + s.c0;
+                const auto exactDelta = exactB * exactB - 4. * q.a * exactC;
+                const auto scaleB =
+                    FLT_EPSILON * (std::abs(s.b1 * ndcX) + std::abs(s.b0));
+                const auto scaleC =
+                    FLT_EPSILON
+                    * (std::abs(s.c2 * ndcX * ndcX) + std::abs(s.c1 * ndcX)
+                       + std::abs(s.c0));
+
+                const auto record = [&](Error &error, float b, float c) {
+                    error.b = qMax(error.b, std::abs(b - exactB) / scaleB);
+                    error.c = qMax(error.c, std::abs(c - exactC) / scaleC);
+                    // Same as the kernels
+                    const auto delta = b * b - 4 * q.a * c;
+                    if ((delta >= 0.f) != (exactDelta >= 0.))
+                        error.wrongSign++;
+                };
+                record(tiled, tileWalker.b, tileWalker.c);
+                record(whole, rowWalker.b, rowWalker.c);
+
+                float b, c;
+                m_renderer.directCoefficients(
+                    (x * 2.f + 1) / w - 1, ndcY, b, c
+                );
+                record(direct, b, c);
+
+                rowWalker.advance();
+                tileWalker.advance();
+            }
+        }
+
+        QJsonArray res;
+        for (const auto &error : {tiled, whole, direct}) {
+            QJsonObject result;
+            result["scenario"]  = scenario.name;
+            result["width"]     = (int)w;
+            result["height"]    = (int)h;
+            result["walk"]      = error.walk;
+            result["samples"]   = (qint64)w * ACCURACY_ROWS;
+            result["maxUlpsB"]  = error.b;
+            result["maxUlpsC"]  = error.c;
+            result["wrongSign"] = (qint64)error.wrongSign;
+            res.append(result);
+        }
+        return res;
+    }
+
+    /// Full-resolution and coarsest passes traced in 'precision', and how
+    /// many pixel centres of the frame it calls a hit or a miss against the
+    /// sign of the exact discriminant of the same coefficients.
+    QJsonObject precision(
+        const Scenario &scenario, Renderer::Precision precision
+    ) {
+        const auto previousPrecision = m_renderer.precision();
+        m_renderer.setPrecision(precision);
+
+        const auto fine   = frame(scenario, REFERENCE_RESOLUTION, 1);
+        const auto coarse = frame(scenario, REFERENCE_RESOLUTION, 16);
+
+        auto params = scenario.params;
+        prepare(params);
+
+        const auto  w = params.width;
+        const auto  h = params.height;
+        const auto &q = m_renderer.coefficients();
+
+        quint64 wrongHits = 0;
+        for (uint y = 0; y < h; y++) {
+            const auto ndcY = (y * 2.f + 1) / h - 1;
+            const ScanlineCoefficients scanline{q, ndcY};
+            ScanlineWalker             walker{scanline, 1. / w - 1, 2. / w};
+
+            // Long double, so that the double solver is checked too
+            const auto exactDelta = [&scanline, &q](long double x) {
+                const auto &s = scanline;
+                const auto  b = s.b1 * x + s.b0;
+                const auto  c = (s.c2 * x + s.c1) * x + s.c0;
+                return b * b - 4 * q.a * c;
+            };
+
+            alignas(32) float ndcXs[PPacket::WIDTH];
+            alignas(32) float bs[PPacket::WIDTH];
+            alignas(32) float cs[PPacket::WIDTH];
+            alignas(32) float hits[PPacket::WIDTH];
+            for (uint x = 0; x + PPacket::WIDTH <= w; x += PPacket::WIDTH) {
+                for (uint l = 0; l < PPacket::WIDTH; l++) {
+                    bs[l] = walker.b;
+                    cs[l] = walker.c;
+                    walker.advance();
+                }
+                const auto ndcX = PPacket::ramp((x * 2.f + 1) / w - 1, 2.f / w);
+                ndcX.store(ndcXs);
+
+                PPacket    z;
+                const auto hit = m_renderer.rayDepths(
+                    ndcX, ndcY, PPacket::load(bs), PPacket::load(cs), z
+                );
+                hit.select(1.f, 0.f).store(hits);
+
+                for (uint l = 0; l < PPacket::WIDTH; l++) {
+                    const auto exactHit = exactDelta(ndcXs[l]) >= 0;
+                    wrongHits          += (hits[l] != 0.f) != exactHit;
+                }
+            }
+        }
+        m_renderer.setPrecision(previousPrecision);
+
+        const auto samples = (quint64)w / PPacket::WIDTH * PPacket::WIDTH * h;
+
+        QJsonObject res;
+        res["scenario"]         = scenario.name;
+        res["frameNs"]          = fine["frameNs"];
+        res["coarseFrameNs"]    = coarse["frameNs"];
+        res["raysHit"]          = fine["raysHit"];
+        res["samples"]          = (qint64)samples;
+        res["wrongHits"]        = (qint64)wrongHits;
+        res["wrongHitFraction"] = (double)wrongHits / samples;
+        return res;
+    }
+
+    /// Efficiency is the single-thread time over threads times the time.
+    QJsonArray scaling(const Scenario &scenario, uint maxThreads) {
+        QList<uint> counts;
+        for (uint threads = 1; threads < maxThreads; threads *= 2)
+            counts.append(threads);
+        counts.append(maxThreads);
+
+        QJsonArray res;
+        qint64     singleNs = 0;
+        for (const auto threads : counts) {
+            m_renderer.setThreadCount(threads);
+            auto frame = this->frame(scenario, REFERENCE_RESOLUTION, 1);
+
+            const auto frameNs = frame["frameNs"].toInteger();
+            if (threads == 1)
+                singleNs = frameNs;
+            frame["efficiency"] = (double)singleNs / (threads * frameNs);
+            res.append(frame);
+        }
+        return res;
+    }
+
+    Renderer &renderer() { return m_renderer; }
+
+private:
+    QByteArray copyFront() {
+        const auto &frame = m_renderer.frames().front();
+        QByteArray  res;
+        for (uint y = 0; y < frame.height(); y++) {
+            res.append(
+                (const char *)frame.constRow(y), frame.width() * COLOR_CHANNELS
+            );
+        }
+        return res;
+    }
+
+    /// Runs a cheap pass, which sets up the matrices the kernels read.
+    void prepare(Params &params) {
+        params.width            = REFERENCE_RESOLUTION.width;
+        params.height           = REFERENCE_RESOLUTION.height;
+        params.pixelGranularity = 16;
+        m_renderer.frames().resize(params.width, params.height);
+        m_renderer.forgetLastPass();
+        m_renderer.renderEllipsoid(params, 0);
+    }
+
+    Renderer    m_renderer;
+    uint        m_repeat;
+    RenderStats m_stats;
+    CacheMisses m_cacheMisses;
+};
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("ellipsoid_benchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Times the ellipsoid ray caster over a fixed matrix of scenarios and "
+        "prints the results as JSON."
+    );
+    parser.addHelpOption();
+
+    const QCommandLineOption repeatOption{
+        "repeat", "Runs per measurement, the median is reported.", "count", "3"
+    };
+    const QCommandLineOption threadsOption{
+        "threads", "Worker threads, ideal thread count by default.", "count"
+    };
+    const QCommandLineOption outputOption{
+        {"o", "output"}, "Writes the JSON there instead of stdout.", "file"
+    };
+    parser.addOption(repeatOption);
+    parser.addOption(threadsOption);
+    parser.addOption(outputOption);
+    parser.process(app);
+
+    QTextStream err{stderr};
+
+    bool       ok;
+    const uint repeat = parser.value(repeatOption).toUInt(&ok);
+    if (!ok || repeat == 0) {
+        err << "Invalid --repeat value" << Qt::endl;
+        return 1;
+    }
+    uint threads = QThread::idealThreadCount();
+    if (parser.isSet(threadsOption)) {
+        threads = parser.value(threadsOption).toUInt(&ok);
+        if (!ok || threads == 0) {
+            err << "Invalid --threads value" << Qt::endl;
+            return 1;
+        }
+    }
+
+    RendererBenchmark benchmark{repeat};
+    benchmark.renderer().setThreadCount(threads);
+    const auto scenarios = ::scenarios();
+
+    QJsonArray kernels;
+    const auto defaultPrecision = benchmark.renderer().precision();
+    for (const auto &[precision, name] : PRECISIONS) {
+        benchmark.renderer().setPrecision(precision);
+        for (const auto &scenario : scenarios) {
+            for (const auto kernel :
+                 {Renderer::Kernel::Scalar, Renderer::Kernel::Packet}) {
+                auto result         = benchmark.kernel(scenario, kernel);
+                result["precision"] = name;
+                kernels.append(result);
+            }
+        }
+    }
+    benchmark.renderer().setPrecision(defaultPrecision);
+
+    // Held to the tolerance in every precision
+    QJsonArray packetAccuracy;
+    bool       packetAccurate = true;
+    for (const auto &[precision, name] : PRECISIONS) {
+        benchmark.renderer().setPrecision(precision);
+        for (const auto &scenario : scenarios) {
+            auto result         = benchmark.packetAccuracy(scenario);
+            result["precision"] = name;
+            if (result["levelsOff"].toDouble() > PACKET_MAX_LEVELS
+                || result["hitsOff"].toInteger() > 0)
+                packetAccurate = false;
+            packetAccuracy.append(result);
+        }
+    }
+    benchmark.renderer().setPrecision(defaultPrecision);
+
+    QJsonArray precision;
+    for (const auto &scenario : scenarios + extremeScenarios()) {
+        for (const auto &[mode, name] : PRECISIONS) {
+            auto result         = benchmark.precision(scenario, mode);
+            result["precision"] = name;
+            precision.append(result);
+        }
+    }
+
+    // Only the renderer's own walks are held to the tolerance
+    QJsonArray accuracy;
+    bool       accurate = true;
+    for (const auto &scenario : scenarios) {
+        for (const auto width : ACCURACY_WIDTHS) {
+            for (const auto &result : benchmark.accuracy(scenario, width)) {
+                const auto object = result.toObject();
+                if (object["walk"] == "tile"
+                    && (object["maxUlpsB"].toDouble() > ACCURACY_MAX_ULPS
+                        || object["maxUlpsC"].toDouble() > ACCURACY_MAX_ULPS))
+                    accurate = false;
+                accuracy.append(result);
+            }
+        }
+    }
+
+    QJsonArray frames;
+    for (const auto &scenario : scenarios)
+        for (const auto &resolution : RESOLUTIONS)
+            for (const auto granularity : GRANULARITIES)
+                frames.append(
+                    benchmark.frame(scenario, resolution, granularity)
+                );
+
+    QJsonArray reprojection;
+    for (const auto &scenario : scenarios)
+        reprojection.append(benchmark.reprojection(scenario));
+
+    QJsonArray tileOrders;
+    for (const auto &scenario : scenarios) {
+        for (const auto &[order, name] : TILE_ORDERS) {
+            auto result     = benchmark.tileOrder(scenario, order);
+            result["order"] = name;
+            tileOrders.append(result);
+        }
+    }
+
+    QJsonArray specular;
+    for (const auto &scenario : scenarios)
+        for (const auto focus : SPECULAR_FOCI)
+            specular.append(benchmark.specular(scenario, focus));
+
+    QJsonArray frameCache;
+    for (const auto &scenario : scenarios)
+        frameCache.append(benchmark.frameCache(scenario));
+
+    QJsonArray supersampling;
+    for (const auto &scenario : scenarios)
+        supersampling.append(benchmark.supersample(scenario));
+
+    QJsonArray instances;
+    for (const auto count : INSTANCE_COUNTS)
+        instances.append(benchmark.instances(count));
+
+    // The scenario tracing the most rays
+    const auto large = std::find_if(
+        scenarios.begin(), scenarios.end(),
+        [](const Scenario &scenario) {
+            return qstrcmp(scenario.name, "large") == 0;
+        }
+    );
+    const auto scaling = benchmark.scaling(*large, threads);
+
+    QJsonObject system;
+    system["cpu"]         = QSysInfo::currentCpuArchitecture();
+    system["threads"]     = (int)threads;
+    system["packetWidth"] = (int)PPacket::WIDTH;
+    system["repeat"]      = (int)repeat;
+
+    QJsonObject results;
+    results["system"]         = system;
+    results["kernels"]        = kernels;
+    results["precision"]      = precision;
+    results["accuracy"]       = accuracy;
+    results["packetAccuracy"] = packetAccuracy;
+    results["frames"]         = frames;
+    results["reprojection"]   = reprojection;
+    results["frameCache"]     = frameCache;
+    results["specular"]       = specular;
+    results["tileOrders"]     = tileOrders;
+    results["supersampling"]  = supersampling;
+    results["instances"]      = instances;
+    results["scaling"]        = scaling;
+    const auto json           = QJsonDocument{results}.toJson();
+
+    if (parser.isSet(outputOption)) {
+        QFile file{parser.value(outputOption)};
+        if (!file.open(QFile::WriteOnly | QFile::Truncate)
+            || file.write(json) != json.size()) {
+            err << "Could not write " << file.fileName() << Qt::endl;
+            return 1;
+        }
+    } else {
+        QTextStream{stdout} << json;
+    }
+
+    if (!packetAccurate) {
+        err << "Packet kernel off the scalar one by more than "
+            << PACKET_MAX_LEVELS << " colour levels" << Qt::endl;
+        return 1;
+    }
+    if (!accurate) {
+        err << "Scanline coefficients off by more than " << ACCURACY_MAX_ULPS
+            << " ulps" << Qt::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef ACCUMULATION_BUFFER_INCLUDED
+#define ACCUMULATION_BUFFER_INCLUDED
+
+#include <QtGlobal>
+
+#include "pixel_buffer.h"
+#include "strided_buffer.h"
+
+/// Per-pixel sums of the light intensities of the samples supersampling has
+/// taken so far. The colour of a pixel is the material times their mean, as
+/// the background is black. Every pass starts by writing the pixels it reads,
+/// so a resize leaves the contents undefined.
+class AccumulationBuffer : public StridedBuffer<float, CACHE_LINE_PIXELS> {};
+
+#endif // ACCUMULATION_BUFFER_INCLUDED
@@ -0,0 +1,57 @@
+#include <new>
+
+#include "buffer_pool.h"
+#include "pixel_buffer.h"
+
+/// Released blocks beyond this many bytes go back to the allocator, enough
+/// for the buffers of a few 4K frames
+constexpr size_t RETAINED_BYTES = 256ull << 20;
+
+BufferPool &BufferPool::instance() {
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::BufferPool() : m_mutex{}, m_free{}, m_freeBytes{0} {}
+
+BufferPool::~BufferPool() {
+    for (const auto &blocks : m_free)
+        for (const auto block : blocks)
+            ::operator delete[](block, std::align_val_t{CACHE_LINE_BYTES});
+}
+
+size_t BufferPool::sizeClass(size_t bytes) {
+    // Quarter steps waste at most a fifth of a block
+    size_t power = CACHE_LINE_BYTES;
+    while (power * 2 < bytes)
+        power *= 2;
+    const auto step = qMax(power / 4, (size_t)CACHE_LINE_BYTES);
+    return (bytes + step - 1) / step * step;
+}
+
+void *BufferPool::acquire(size_t bytes) {
+    const auto capacity = sizeClass(bytes);
+    {
+        QMutexLocker lock{&m_mutex};
+        auto        &free = m_free[capacity];
+        if (!free.isEmpty()) {
+            m_freeBytes -= capacity;
+            return free.takeLast();
+        }
+    }
+    return ::operator new[](capacity, std::align_val_t{CACHE_LINE_BYTES});
+}
+
+void BufferPool::release(void *block, size_t capacity) {
+    if (block == nullptr)
+        return;
+    {
+        QMutexLocker lock{&m_mutex};
+        if (m_freeBytes + capacity <= RETAINED_BYTES) {
+            m_free[capacity].append(block);
+            m_freeBytes += capacity;
+            return;
+        }
+    }
+    ::operator delete[](block, std::align_val_t{CACHE_LINE_BYTES});
+}
@@ -0,0 +1,39 @@
+#ifndef BUFFER_POOL_INCLUDED
+#define BUFFER_POOL_INCLUDED
+
+#include <cstddef>
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+
+/// Cache-line aligned blocks in size classes a quarter of a power of two
+/// apart, shared by every StridedBuffer. Released blocks are kept for reuse up
+/// to a limit, so that buffers resized back and forth while the window is
+/// dragged stop hitting the allocator. Thread-safe.
+class BufferPool {
+public:
+    static BufferPool &instance();
+
+    ~BufferPool();
+
+    BufferPool(const BufferPool &)            = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    /// Smallest size class holding 'bytes'.
+    static size_t sizeClass(size_t bytes);
+
+    /// A block of sizeClass(bytes), with undefined contents.
+    void *acquire(size_t bytes);
+    /// 'capacity' must be the size class the block was acquired with.
+    void  release(void *block, size_t capacity);
+
+private:
+    BufferPool();
+
+    QMutex                       m_mutex;
+    QHash<size_t, QList<void *>> m_free;
+    size_t                       m_freeBytes;
+};
+
+#endif // BUFFER_POOL_INCLUDED
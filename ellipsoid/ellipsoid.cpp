@@ -1,13 +1,20 @@
+#include <cstring>
+#include <utility>
+
+#include <QPainter>
 #include <QTimer>
 
 #include "ellipsoid.h"
 
-constexpr uint COLOR_CHANNELS = 4;
+/// Pixels between the stats overlay and the corner of the view
+constexpr int STATS_OVERLAY_MARGIN = 8;
 
-constexpr QOpenGLTexture::PixelFormat PIXEL_FORMAT =
-    QOpenGLTexture::PixelFormat::RGBA;
-constexpr QOpenGLTexture::PixelType PIXEL_TYPE =
-    QOpenGLTexture::PixelType::UInt8;
+// Pixel buffers are uploaded as they are, without any conversion. The
+// QOpenGLTexture enumerators are the GL constants.
+constexpr auto PIXEL_FORMAT =
+    (QOpenGLTexture::PixelFormat)PIXEL_BUFFER_TRAITS.glFormat;
+constexpr auto PIXEL_TYPE =
+    (QOpenGLTexture::PixelType)PIXEL_BUFFER_TRAITS.glType;
 constexpr QOpenGLTexture::Target TEXTURE_TARGET =
     QOpenGLTexture::Target::Target2D;
 
@@ -63,22 +70,81 @@ const char *fragmentShader =
     "}\n";
 
 Ellipsoid::Ellipsoid(QWidget *parent, Qt::WindowFlags f)
-    : QOpenGLWidget{parent, f}, m_initialPixelGranularity{8}, m_dirty{false},
-      m_renderOngoing{true},
-      m_params{0,   0,   1,   255, 255, 0,    0.f,  0.f,  0.f,  1.f,
-               4.f, 2.f, 1.f, 0.f, 0.f, 10.f, 0.1f, 0.2f, 0.6f, 10.f},
-      m_lastParams{}, m_renderer{this}, m_pixelData{}, m_worker{}, m_logger{},
-      m_program{}, m_vao{}, m_texture{TEXTURE_TARGET}, m_quad{}, m_tex{} {
+    : QOpenGLWidget{parent, f}, m_initialPixelGranularity{8},
+      m_adaptiveRefinement{false}, m_reprojection{false},
+      m_frameCacheBudgetMb{0}, m_supersampleBudget{DEFAULT_SUPERSAMPLE_BUDGET},
+      m_tileWidth{0}, m_tileHeight{0}, m_threadCount{0}, m_dirty{false},
+      m_renderOngoing{true}, m_generation{0}, m_exportId{0},
+      m_params{DEFAULT_PARAMS}, m_lastParams{}, m_pacer{}, m_renderer{},
+      m_worker{}, m_logger{}, m_program{}, m_vao{}, m_texture{TEXTURE_TARGET},
+      m_quad{}, m_tex{}, m_pendingUpload{}, m_pendingStream{}, m_streamed{},
+      m_unpackBuffers{}, m_nextUnpackBuffer{0}, m_clock{}, m_requestedNs{0},
+      m_streamedBytes{0}, m_unpresented{}, m_statsHistory{},
+      m_statsOverlay{false} {
     QSurfaceFormat fmt;
     fmt.setVersion(3, 3);
     fmt.setProfile(QSurfaceFormat::CoreProfile);
     fmt.setOption(QSurfaceFormat::DebugContext);
     setFormat(fmt);
 
+    m_reprojection       = m_renderer.reprojection();
+    m_frameCacheBudgetMb = m_renderer.frameCache().budget() >> 20;
+    m_tileWidth          = m_renderer.tileWidth();
+    m_tileHeight         = m_renderer.tileHeight();
+    m_threadCount        = m_renderer.threadCount();
+
     m_renderer.moveToThread(&m_worker);
-    m_renderer.setupConnection();
+    QObject::connect(
+        this, &Ellipsoid::renderRequested, &m_renderer,
+        &Renderer::renderEllipsoid, Qt::QueuedConnection
+    );
+    QObject::connect(
+        this, &Ellipsoid::supersampleRequested, &m_renderer,
+        &Renderer::supersample, Qt::QueuedConnection
+    );
+    QObject::connect(
+        this, &Ellipsoid::adaptiveRefinementRequested, &m_renderer,
+        &Renderer::setAdaptiveRefinement, Qt::QueuedConnection
+    );
+    QObject::connect(
+        this, &Ellipsoid::reprojectionRequested, &m_renderer,
+        &Renderer::setReprojection, Qt::QueuedConnection
+    );
+    QObject::connect(
+        this, &Ellipsoid::frameCacheBudgetRequested, &m_renderer,
+        &Renderer::setFrameCacheBudget, Qt::QueuedConnection
+    );
+    QObject::connect(
+        this, &Ellipsoid::tileSizeRequested, &m_renderer,
+        &Renderer::setTileSize, Qt::QueuedConnection
+    );
+    QObject::connect(
+        this, &Ellipsoid::threadCountRequested, &m_renderer,
+        &Renderer::setThreadCount, Qt::QueuedConnection
+    );
+    QObject::connect(
+        this, &Ellipsoid::exportRequested, &m_renderer, &Renderer::exportImage,
+        Qt::QueuedConnection
+    );
+    QObject::connect(
+        &m_renderer, &Renderer::exportProgressed, this,
+        &Ellipsoid::exportProgressed, Qt::QueuedConnection
+    );
+    QObject::connect(
+        &m_renderer, &Renderer::exportCompleted, this,
+        &Ellipsoid::exportCompleted, Qt::QueuedConnection
+    );
+    QObject::connect(
+        &m_renderer, &Renderer::exportFailed, this, &Ellipsoid::exportFailed,
+        Qt::QueuedConnection
+    );
+    QObject::connect(
+        &m_renderer, &Renderer::exportCancelled, this,
+        &Ellipsoid::exportCancelled, Qt::QueuedConnection
+    );
 
     m_worker.start();
+    m_clock.start();
 }
 
 Ellipsoid::~Ellipsoid() {
@@ -90,8 +156,28 @@ uint Ellipsoid::initialPixelGranularity() const {
     return m_initialPixelGranularity;
 }
 
+int Ellipsoid::frameBudgetMs() const { return m_pacer.budgetNs() / 1'000'000; }
+
+bool Ellipsoid::adaptiveRefinement() const { return m_adaptiveRefinement; }
+
+bool Ellipsoid::reprojection() const { return m_reprojection; }
+
+int Ellipsoid::frameCacheBudgetMb() const { return m_frameCacheBudgetMb; }
+
+uint Ellipsoid::supersampleBudget() const { return m_supersampleBudget; }
+
+uint Ellipsoid::tileWidth() const { return m_tileWidth; }
+
+uint Ellipsoid::tileHeight() const { return m_tileHeight; }
+
+uint Ellipsoid::threadCount() const { return m_threadCount; }
+
 const Params &Ellipsoid::currentParams() const { return m_params; }
 
+const StatsHistory &Ellipsoid::statsHistory() const { return m_statsHistory; }
+
+bool Ellipsoid::statsOverlay() const { return m_statsOverlay; }
+
 void Ellipsoid::setStretchX(double value) {
     m_params.stretchX = value;
     requestFreshRenderIfPossible();
@@ -136,6 +222,66 @@ void Ellipsoid::setInitialPixelGranularity(int value) {
     m_initialPixelGranularity = value;
 }
 
+void Ellipsoid::setFrameBudgetMs(int value) {
+    m_pacer.setBudgetNs(value * 1'000'000ll);
+}
+
+void Ellipsoid::setAdaptiveRefinement(bool value) {
+    m_adaptiveRefinement = value;
+    emit adaptiveRefinementRequested(m_adaptiveRefinement);
+}
+
+void Ellipsoid::setReprojection(bool value) {
+    m_reprojection = value;
+    emit reprojectionRequested(m_reprojection);
+}
+
+void Ellipsoid::setFrameCacheBudgetMb(int value) {
+    m_frameCacheBudgetMb = value;
+    emit frameCacheBudgetRequested((qint64)m_frameCacheBudgetMb << 20);
+}
+
+void Ellipsoid::setSupersampleBudget(int value) {
+    m_supersampleBudget = qMax(value, 1);
+}
+
+void Ellipsoid::setTileWidth(int value) {
+    m_tileWidth = value;
+    emit tileSizeRequested(m_tileWidth, m_tileHeight);
+}
+
+void Ellipsoid::setTileHeight(int value) {
+    m_tileHeight = value;
+    emit tileSizeRequested(m_tileWidth, m_tileHeight);
+}
+
+void Ellipsoid::setThreadCount(int value) {
+    m_threadCount = value;
+    emit threadCountRequested(m_threadCount);
+}
+
+void Ellipsoid::setStatsOverlay(bool value) {
+    m_statsOverlay = value;
+    update();
+}
+
+bool Ellipsoid::dumpStats(const QString &path) const {
+    return m_statsHistory.save(path);
+}
+
+quint64 Ellipsoid::exportImage(const QString &path, uint width, uint height) {
+    auto params             = m_params;
+    params.width            = width;
+    params.height           = height;
+    params.pixelGranularity = 1;
+    emit exportRequested(params, path, ++m_exportId);
+    return m_exportId;
+}
+
+void Ellipsoid::cancelExport() {
+    m_renderer.cancelExportsBefore(m_exportId + 1);
+}
+
 void Ellipsoid::initializeGL() {
     auto w = width();
     auto h = height();
@@ -153,7 +299,7 @@ void Ellipsoid::initializeGL() {
     glClearColor(0, 0, 0.5, 1);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    m_pixelData.resize(w * h * COLOR_CHANNELS);
+    m_renderer.frames().resize(w, h);
 
     m_program.create();
     m_vao.create();
@@ -168,16 +314,15 @@ void Ellipsoid::initializeGL() {
     m_program.bind();
     m_vao.bind();
 
-    m_texture.bind();
+    allocateTexture(w, h);
 
-    m_texture.setSize(w, h);
-    m_texture.setMipLevels(0);
-    m_texture.setBorderColor(1.f, 1.f, 1.f, 1.f);
-    m_texture.setWrapMode(QOpenGLTexture::WrapMode::ClampToBorder);
-    m_texture.setFormat(QOpenGLTexture::TextureFormat::RGBA8_UNorm);
-    m_texture.setMinificationFilter(QOpenGLTexture::Filter::Nearest);
-    m_texture.setMagnificationFilter(QOpenGLTexture::Filter::Nearest);
-    m_texture.allocateStorage(PIXEL_FORMAT, PIXEL_TYPE);
+    // Storage starts out undefined, the first upload covers all of it
+    m_pendingUpload = QRect(0, 0, w, h);
+    for (auto &buffer : m_unpackBuffers) {
+        buffer = QOpenGLBuffer{QOpenGLBuffer::PixelUnpackBuffer};
+        buffer.create();
+        buffer.setUsagePattern(QOpenGLBuffer::UsagePattern::StreamDraw);
+    }
 
     m_program.setUniformValue("screen", 0);
 
@@ -211,15 +356,49 @@ void Ellipsoid::initializeGL() {
         &Ellipsoid::cleanup
     );
 
+    QObject::connect(
+        &m_renderer, &Renderer::renderProgressed, this,
+        &Ellipsoid::handleProgress, Qt::QueuedConnection
+    );
     QObject::connect(
         &m_renderer, &Renderer::renderCompleted, this, &Ellipsoid::handleRender,
         Qt::QueuedConnection
     );
+    QObject::connect(
+        &m_renderer, &Renderer::renderCancelled, this, &Ellipsoid::handleCancel,
+        Qt::QueuedConnection
+    );
 
     m_renderOngoing = false;
     requestFreshRenderIfPossible();
 }
 
+void Ellipsoid::resizeGL(int w, int h) {
+    if ((uint)w == m_params.width && (uint)h == m_params.height)
+        return;
+
+    // Whatever is in flight renders the old size, the frame buffers take the
+    // new one as the next pass begins
+    m_renderer.cancelBefore(++m_generation);
+    m_params.width  = w;
+    m_params.height = h;
+    m_renderer.frames().resize(w, h);
+
+    glViewport(0, 0, w, h);
+    allocateTexture(w, h);
+    m_pendingUpload = QRect(0, 0, w, h);
+    m_pendingStream = {};
+    m_streamed      = {};
+    // Passes of the old size never make it to the screen
+    m_unpresented.clear();
+
+    // The pacer knows nothing about this size yet, and while the window is
+    // dragged the next resize is only a few milliseconds away
+    m_params.pixelGranularity = m_initialPixelGranularity;
+    if (!m_renderOngoing)
+        requestRenderUnsafe();
+}
+
 void Ellipsoid::paintGL() {
     glClear(GL_COLOR_BUFFER_BIT);
 
@@ -227,28 +406,50 @@ void Ellipsoid::paintGL() {
     m_texture.bind();
     m_program.bind();
 
-    m_texture.setData(
-        PIXEL_FORMAT, PIXEL_TYPE, m_pixelData.constData(), nullptr
-    );
-
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    // Only handleRender swaps buffers, so the front one stays intact. Tiles
+    // streamed from the back one are newer, they go last. After a resize the
+    // front buffer has the old size until a frame of the new one is swapped
+    // in, the texture holds nothing to draw until then.
+    const auto &frames        = m_renderer.frames();
+    const auto &front         = frames.front();
+    const auto  current       = front.width() == m_params.width
+                         && front.height() == m_params.height;
+    const auto  streamed      = m_pendingStream;
+    const auto  uploaded      = current ? uploadRegion(front, m_pendingUpload)
+                                        : 0;
+    const auto  streamedBytes = uploadRegion(frames.back(), m_pendingStream);
+    m_streamed               |= streamed.subtracted(m_pendingStream);
+    m_streamedBytes          += streamedBytes;
+
+    if (current)
+        glDrawArrays(GL_TRIANGLES, 0, 6);
 
     m_vao.release();
     m_texture.release();
     m_program.release();
 
+    // Passes swapped in since the last paint are on screen now. The front
+    // buffer upload covers all of them, it is counted for the newest.
+    const auto presentedNs = m_clock.nsecsElapsed();
+    for (qsizetype i = 0; i < m_unpresented.size(); i++) {
+        auto &[stats, requestedNs] = m_unpresented[i];
+        stats.latencyNs            = presentedNs - requestedNs;
+        if (i == m_unpresented.size() - 1)
+            stats.uploadBytes += uploaded;
+        qCDebug(lcRenderStats).noquote() << (QString)stats;
+        m_statsHistory.append(stats);
+    }
+    m_unpresented.clear();
+
+    if (m_statsOverlay)
+        drawStatsOverlay();
+
     for (const auto &m : m_logger.loggedMessages())
         DPRINT(m);
 
+    qCDebug(lcRenderStats) << "Frame uploaded bytes:"
+                           << uploaded + streamedBytes;
     DPRINT("Display updated.");
-
-    if (m_lastParams != m_params) {
-        DPRINT("Requesting re-render...");
-        requestRenderUnsafe();
-    } else {
-        DPRINT("End of rendering chain.");
-        m_renderOngoing = false;
-    }
 }
 
 void Ellipsoid::mouseMoveEvent(QMouseEvent *event) {
@@ -319,6 +520,10 @@ void Ellipsoid::keyPressEvent(QKeyEvent *event) {
     case Qt::Key_D:
         m_params.positionX = qMin(m_params.positionX + 0.1f, 3.f);
         break;
+    case Qt::Key_F3:
+        event->accept();
+        setStatsOverlay(!m_statsOverlay);
+        return;
     default:
         return;
     }
@@ -329,7 +534,12 @@ void Ellipsoid::keyPressEvent(QKeyEvent *event) {
 }
 
 void Ellipsoid::requestFreshRenderIfPossible() {
-    m_params.pixelGranularity = m_initialPixelGranularity;
+    m_params.pixelGranularity = m_pacer.startingGranularity(
+        m_params.width, m_params.height, m_initialPixelGranularity
+    );
+
+    // Whatever is in flight renders outdated params now
+    m_renderer.cancelBefore(++m_generation);
 
     if (m_renderOngoing)
         return;
@@ -341,12 +551,172 @@ void Ellipsoid::requestFreshRenderIfPossible() {
 void Ellipsoid::requestRenderUnsafe() {
     m_renderOngoing = true;
     m_lastParams    = m_params;
-    emit renderRequested(m_params);
+    m_requestedNs   = m_clock.nsecsElapsed();
+    emit renderRequested(m_params, m_generation);
     if (m_params.pixelGranularity > 1)
         m_params.pixelGranularity /= 2;
 }
 
-void Ellipsoid::handleRender() { update(); }
+void Ellipsoid::allocateTexture(int w, int h) {
+    // Storage cannot be reallocated, a new size takes a new texture
+    if (m_texture.isStorageAllocated()) {
+        m_texture.destroy();
+        m_texture.create();
+    }
+
+    m_texture.bind();
+
+    m_texture.setSize(w, h);
+    m_texture.setMipLevels(0);
+    m_texture.setBorderColor(1.f, 1.f, 1.f, 1.f);
+    m_texture.setWrapMode(QOpenGLTexture::WrapMode::ClampToBorder);
+    m_texture.setFormat(QOpenGLTexture::TextureFormat::RGBA8_UNorm);
+    m_texture.setMinificationFilter(QOpenGLTexture::Filter::Nearest);
+    m_texture.setMagnificationFilter(QOpenGLTexture::Filter::Nearest);
+    m_texture.allocateStorage(PIXEL_FORMAT, PIXEL_TYPE);
+}
+
+void Ellipsoid::drawStatsOverlay() {
+    auto lines = m_statsHistory.summary().lines();
+    if (!m_statsHistory.passes().isEmpty()) {
+        const auto &last = m_statsHistory.passes().last();
+        lines.prepend(QString("Last pass: %1 ms at granularity %2")
+                          .arg(last.durationNs / 1e6, 0, 'f', 2)
+                          .arg(last.pixelGranularity));
+    }
+
+    // Shadowed, so that it reads over the ellipsoid as well as around it
+    QPainter   painter{this};
+    const auto text  = lines.join('\n');
+    const auto flags = Qt::AlignLeft | Qt::AlignTop;
+    const auto area  = rect().adjusted(
+        STATS_OVERLAY_MARGIN, STATS_OVERLAY_MARGIN, -STATS_OVERLAY_MARGIN,
+        -STATS_OVERLAY_MARGIN
+    );
+    painter.setPen(Qt::black);
+    painter.drawText(area.translated(1, 1), flags, text);
+    painter.setPen(Qt::white);
+    painter.drawText(area, flags, text);
+}
+
+qsizetype Ellipsoid::uploadRegion(const PixelBuffer &frame, QRegion &region) {
+    region &= QRect(0, 0, frame.width(), frame.height());
+
+    qsizetype bytes = 0;
+    QRegion   failed;
+    for (const auto &rect : region) {
+        const auto uploaded = uploadRect(frame, rect);
+        if (uploaded == 0)
+            failed += rect;
+        bytes += uploaded;
+    }
+    region = failed;
+    return bytes;
+}
+
+qsizetype Ellipsoid::uploadRect(const PixelBuffer &frame, const QRect &rect) {
+    const qsizetype rowBytes = rect.width() * COLOR_CHANNELS;
+    const qsizetype bytes    = rowBytes * rect.height();
+
+    // Reallocating orphans the storage a previous transfer may still be
+    // reading from, and cycling through several buffers keeps the driver
+    // from having to wait for it either way. The texture update itself
+    // then proceeds asynchronously from the buffer.
+    auto &buffer       = m_unpackBuffers[m_nextUnpackBuffer];
+    m_nextUnpackBuffer = (m_nextUnpackBuffer + 1) % UNPACK_BUFFER_COUNT;
+
+    buffer.bind();
+    buffer.allocate(bytes);
+    auto mapped = (uchar *)buffer.mapRange(
+        0, bytes,
+        QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer
+    );
+    if (!mapped) {
+        buffer.release();
+        DPRINT("Could not map pixel unpack buffer.");
+        return 0;
+    }
+
+    for (int y = 0; y < rect.height(); y++) {
+        memcpy(
+            mapped + y * rowBytes, frame.constRow(rect.y() + y) + rect.x(),
+            rowBytes
+        );
+    }
+    buffer.unmap();
+
+    // With an unpack buffer bound, the data pointer is an offset into it
+    glTexSubImage2D(
+        GL_TEXTURE_2D, 0, rect.x(), rect.y(), rect.width(), rect.height(),
+        PIXEL_BUFFER_TRAITS.glFormat, PIXEL_BUFFER_TRAITS.glType, nullptr
+    );
+    buffer.release();
+
+    return bytes;
+}
+
+void Ellipsoid::handleRender(RenderStats stats) {
+    m_pacer.record(stats);
+    // Tiles streamed while it ran were uploaded for this pass
+    stats.uploadBytes = std::exchange(m_streamedBytes, 0);
+    m_unpresented.append({stats, m_requestedNs});
+
+    // The finished pass becomes the front buffer, then the worker starts on
+    // the next one while this one is uploaded. Passes swapped in before the
+    // next paint all add to what the texture is missing.
+    m_renderer.frames().swap();
+    // Streamed tiles already show this pass
+    m_pendingUpload |= QRegion{stats.dirtyRect}.subtracted(m_streamed);
+    m_pendingStream  = {};
+    m_streamed       = {};
+
+    // Passes shaded from an earlier frame may come out finer than requested,
+    // the chain then carries on from there unless the params changed since
+    if (stats.pixelGranularity < m_lastParams.pixelGranularity) {
+        auto delivered             = m_lastParams;
+        delivered.pixelGranularity = m_params.pixelGranularity;
+        if (delivered == m_params)
+            m_params.pixelGranularity = qMax(stats.pixelGranularity / 2, 1u);
+        m_lastParams.pixelGranularity = stats.pixelGranularity;
+    }
+
+    // Idle at full resolution, the silhouette is refined one sample at a
+    // time. New params cancel that through the generation, and handleCancel
+    // then starts their chain.
+    if (m_lastParams != m_params) {
+        DPRINT("Requesting re-render...");
+        requestRenderUnsafe();
+    } else if (!stats.cached && stats.samples > 0
+               && stats.samples < m_supersampleBudget) {
+        DPRINT("Requesting supersampling...");
+        m_requestedNs = m_clock.nsecsElapsed();
+        emit supersampleRequested(m_params, m_generation);
+    } else {
+        DPRINT("End of rendering chain.");
+        m_renderOngoing = false;
+    }
+
+    update();
+}
+
+void Ellipsoid::handleProgress(quint64 generation, QRegion finished) {
+    // Tiles of a pass that is being cancelled may be overwritten any time
+    if (generation != m_generation)
+        return;
+    m_pendingStream |= finished;
+    update();
+}
+
+void Ellipsoid::handleCancel(quint64) {
+    // The texture must not keep tiles of a pass that never completed
+    m_pendingUpload |= m_streamed;
+    m_pendingStream  = {};
+    m_streamed       = {};
+    m_streamedBytes  = 0;
+
+    DPRINT("Render cancelled, restarting with newest params...");
+    requestRenderUnsafe();
+}
 
 void Ellipsoid::cleanup() {
     makeCurrent();
@@ -355,6 +725,8 @@ void Ellipsoid::cleanup() {
     m_vao.destroy();
     m_quad.destroy();
     m_tex.destroy();
+    for (auto &buffer : m_unpackBuffers)
+        buffer.destroy();
     doneCurrent();
 
     QObject::disconnect(
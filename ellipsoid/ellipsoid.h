@@ -13,20 +13,37 @@
 #include <QThread>
 #include <QTime>
 
+#include "frame_pacer.h"
 #include "renderer.h"
+#include "stats_history.h"
+
+/// Pixel unpack buffers cycled through by texture uploads
+constexpr uint UNPACK_BUFFER_COUNT = 3;
+
+/// Samples per pixel along the silhouette idle supersampling stops at
+constexpr uint DEFAULT_SUPERSAMPLE_BUDGET = 16;
 
 class Ellipsoid : public QOpenGLWidget, protected QOpenGLFunctions {
     Q_OBJECT
 
-    friend Renderer;
-
 public:
     Ellipsoid(QWidget *parent = nullptr, Qt::WindowFlags f = Qt::WindowFlags());
     ~Ellipsoid();
 
     uint initialPixelGranularity() const;
+    int  frameBudgetMs() const;
+    bool adaptiveRefinement() const;
+    bool reprojection() const;
+    int  frameCacheBudgetMb() const;
+    uint supersampleBudget() const;
+    uint tileWidth() const;
+    uint tileHeight() const;
+    uint threadCount() const;
 
     const Params &currentParams() const;
+    /// Latest passes presented, with their upload bytes and latency.
+    const StatsHistory &statsHistory() const;
+    bool                statsOverlay() const;
 
 public slots:
     void setStretchX(double value);
@@ -40,13 +57,57 @@ public slots:
 
     void setScale(double value);
 
+    /// Coarsest granularity a chain may start at, finer ones are picked when
+    /// they are predicted to fit the frame budget.
     void setInitialPixelGranularity(int value);
+    void setFrameBudgetMs(int value);
+    /// Refine only blocks whose corners differ, interpolate the rest.
+    void setAdaptiveRefinement(bool value);
+    /// Warp the last frame into the new view while the camera moves, instead
+    /// of starting over from coarse blocks.
+    void setReprojection(bool value);
+    /// Memory kept for finished frames, which revisited views are presented
+    /// from at once. 0 disables the cache.
+    void setFrameCacheBudgetMb(int value);
+    /// Once the chain reaches full resolution, pixels along the silhouette
+    /// keep taking jittered samples, one per pass, until they average this
+    /// many. Any change cancels that like any other pass. 1 disables it.
+    void setSupersampleBudget(int value);
+    void setTileWidth(int value);
+    void setTileHeight(int value);
+    void setThreadCount(int value);
+    /// Draws the summary of statsHistory() over the frame, F3 toggles it.
+    void setStatsOverlay(bool value);
+    /// Writes statsHistory() as JSON if the path ends with .json, as CSV
+    /// otherwise.
+    bool dumpStats(const QString &path) const;
+    /// Renders the current scene at this size into an image file whose format
+    /// follows the suffix of 'path', see Renderer::exportImage. The view
+    /// stops refining until the export is done. Returns the id the export
+    /// signals carry.
+    quint64 exportImage(const QString &path, uint width, uint height);
+    /// Stops the export in progress, if any, leaving no file behind.
+    void    cancelExport();
 
 signals:
-    void renderRequested(Params params);
+    void renderRequested(Params params, quint64 generation);
+    void supersampleRequested(Params params, quint64 generation);
+    void adaptiveRefinementRequested(bool value);
+    void reprojectionRequested(bool value);
+    void frameCacheBudgetRequested(qint64 bytes);
+    void tileSizeRequested(uint width, uint height);
+    void threadCountRequested(uint count);
+    void exportRequested(Params params, QString path, quint64 id);
+
+    /// Forwarded from the renderer's thread.
+    void exportProgressed(quint64 id, uint rowsWritten);
+    void exportCompleted(quint64 id, QString path);
+    void exportFailed(quint64 id, QString error);
+    void exportCancelled(quint64 id);
 
 protected:
     void initializeGL() override;
+    void resizeGL(int w, int h) override;
     void paintGL() override;
 
     void mouseMoveEvent(QMouseEvent *event) override;
@@ -58,22 +119,41 @@ protected:
     void keyPressEvent(QKeyEvent *event) override;
 
 private slots:
-    void handleRender();
+    void handleProgress(quint64 generation, QRegion finished);
+    void handleRender(RenderStats stats);
+    void handleCancel(quint64 generation);
     void cleanup();
 
 private:
     void requestFreshRenderIfPossible();
     void requestRenderUnsafe();
+    /// Binds the texture, with storage for a frame of this size.
+    void allocateTexture(int w, int h);
+    /// Returns the number of bytes transferred, leaving in 'region' what
+    /// could not be.
+    qsizetype uploadRegion(const PixelBuffer &frame, QRegion &region);
+    /// Returns the number of bytes transferred, 0 on failure.
+    qsizetype uploadRect(const PixelBuffer &frame, const QRect &rect);
+    void      drawStatsOverlay();
 
     QPointF m_lastMousePos;
     uint    m_initialPixelGranularity;
+    bool    m_adaptiveRefinement;
+    bool    m_reprojection;
+    int     m_frameCacheBudgetMb;
+    uint    m_supersampleBudget;
+    uint    m_tileWidth;
+    uint    m_tileHeight;
+    uint    m_threadCount;
 
     bool           m_dirty;
     bool           m_renderOngoing;
+    quint64        m_generation;
+    quint64        m_exportId;
     Params         m_params;
     Params         m_lastParams;
+    FramePacer     m_pacer;
     Renderer       m_renderer;
-    QList<GLubyte> m_pixelData;
     QThread        m_worker;
 
     QOpenGLDebugLogger       m_logger;
@@ -82,6 +162,27 @@ private:
     QOpenGLTexture           m_texture;
     QOpenGLBuffer            m_quad;
     QOpenGLBuffer            m_tex;
+
+    /// Part of the front buffer the texture does not hold yet
+    QRegion       m_pendingUpload;
+    /// Finished tiles of the pass in progress the texture does not hold yet
+    QRegion       m_pendingStream;
+    /// Where the texture holds the pass in progress instead of the front
+    /// buffer
+    QRegion       m_streamed;
+    QOpenGLBuffer m_unpackBuffers[UNPACK_BUFFER_COUNT];
+    uint          m_nextUnpackBuffer;
+
+    QElapsedTimer m_clock;
+    /// When the pass in flight was requested, on m_clock
+    qint64        m_requestedNs;
+    /// Streamed to the texture for the pass in flight so far
+    qint64        m_streamedBytes;
+    /// Passes swapped to the front since the last paint, with when they were
+    /// requested
+    QList<std::pair<RenderStats, qint64>> m_unpresented;
+    StatsHistory                          m_statsHistory;
+    bool                                  m_statsOverlay;
 };
 
 #endif // ELLIPSOID_INCLUDED
@@ -0,0 +1,63 @@
+#include "frame_buffers.h"
+
+FrameBuffers::FrameBuffers()
+    : m_mutex{}, m_buffers{}, m_front{0}, m_backIsLatest{false},
+      m_sizeMutex{}, m_width{0}, m_height{0}, m_resizeCount{0} {}
+
+void FrameBuffers::resize(uint width, uint height) {
+    QMutexLocker lock{&m_sizeMutex};
+    if (width == m_width && height == m_height)
+        return;
+    m_width  = width;
+    m_height = height;
+    m_resizeCount++;
+}
+
+uint FrameBuffers::resizeCount() {
+    QMutexLocker lock{&m_sizeMutex};
+    return m_resizeCount;
+}
+
+PixelBuffer &FrameBuffers::beginPass(bool keepLatest) {
+    m_mutex.lock();
+    auto       &front = m_buffers[m_front];
+    auto       &back  = m_buffers[1 - m_front];
+    const auto  fresh = !hasCurrentSize(back);
+    if (fresh) {
+        QMutexLocker lock{&m_sizeMutex};
+        back.resize(m_width, m_height);
+    }
+    // The front buffer keeps the old size until a pass of the new one is
+    // presented, there is nothing to keep until then
+    if (keepLatest && (fresh || !m_backIsLatest)
+        && front.width() == back.width() && front.height() == back.height())
+        back.copyFrom(front);
+    return back;
+}
+
+void FrameBuffers::endPass(bool completed) {
+    m_backIsLatest = completed;
+    m_mutex.unlock();
+}
+
+const PixelBuffer &FrameBuffers::front() const { return m_buffers[m_front]; }
+
+const PixelBuffer &FrameBuffers::back() const {
+    return m_buffers[1 - m_front];
+}
+
+bool FrameBuffers::swap() {
+    QMutexLocker lock{&m_mutex};
+    // A pass completed before a resize must not replace a frame of the new
+    // size
+    if (!m_backIsLatest || !hasCurrentSize(m_buffers[1 - m_front]))
+        return false;
+    m_front        = 1 - m_front;
+    m_backIsLatest = false;
+    return true;
+}
+
+bool FrameBuffers::hasCurrentSize(const PixelBuffer &buffer) {
+    QMutexLocker lock{&m_sizeMutex};
+    return buffer.width() == m_width && buffer.height() == m_height;
+}
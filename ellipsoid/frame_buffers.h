@@ -0,0 +1,58 @@
+#ifndef FRAME_BUFFERS_INCLUDED
+#define FRAME_BUFFERS_INCLUDED
+
+#include <QMutex>
+
+#include "pixel_buffer.h"
+
+/// Front and back pixel buffers shared by the render thread, which fills the
+/// back one, and the GUI thread, which uploads the front one. The buffers only
+/// change roles in swap(), which cannot happen in the middle of a pass, so an
+/// uploaded frame is never half-written. The front buffer is never written, so
+/// the GUI thread reads it without locking. For the same reason a new size
+/// only reaches a buffer while it is the back one, the front buffer keeps the
+/// old size until a frame of the new one is swapped in.
+class FrameBuffers {
+public:
+    FrameBuffers();
+
+    /// Returns right away, the back buffer takes the size when the next pass
+    /// begins and is cleared then.
+    void resize(uint width, uint height);
+    /// Number of size changes so far.
+    uint resizeCount();
+
+    // Render thread
+
+    /// Locks the back buffer for the duration of a pass. With 'keepLatest'
+    /// it starts out as a copy of the latest completed frame.
+    PixelBuffer &beginPass(bool keepLatest);
+    void         endPass(bool completed);
+
+    // GUI thread
+
+    const PixelBuffer &front() const;
+    /// Only the tiles Renderer::renderProgressed reported for the pass in
+    /// progress may be read, and only until the next pass begins.
+    const PixelBuffer &back() const;
+    /// Presents the latest completed pass, returns false if there is none of
+    /// the current size.
+    bool swap();
+
+private:
+    bool hasCurrentSize(const PixelBuffer &buffer);
+
+    /// Held from beginPass to endPass.
+    QMutex      m_mutex;
+    PixelBuffer m_buffers[2];
+    uint        m_front;
+    bool        m_backIsLatest;
+
+    /// Only ever held briefly, so that resizing never waits for a pass.
+    QMutex m_sizeMutex;
+    uint   m_width;
+    uint   m_height;
+    uint   m_resizeCount;
+};
+
+#endif // FRAME_BUFFERS_INCLUDED
@@ -0,0 +1,135 @@
+#include <cmath>
+
+#include <QHash>
+
+#include "frame_cache.h"
+#include "renderer.h"
+
+/// Floats of a key are rounded to multiples of this, well below what a pixel
+/// of mouse drag turns the camera by
+constexpr float KEY_STEP = 1.f / 8192;
+
+struct FrameCache::Entry {
+    Params      key;
+    size_t      hash;
+    PixelBuffer pixels;
+    QRect       hitBounds;
+
+    qint64 bytes() const {
+        return (qint64)pixels.stride() * pixels.height() * COLOR_CHANNELS;
+    }
+};
+
+/// Float members of Params, every one of them rounded in a key
+constexpr float Params::*KEY_FLOATS[] = {
+    &Params::positionX,
+    &Params::positionY,
+    &Params::positionZ,
+    &Params::scale,
+    &Params::stretchX,
+    &Params::stretchY,
+    &Params::stretchZ,
+    &Params::cameraAngleX,
+    &Params::cameraAngleY,
+    &Params::cameraDistance,
+    &Params::lightAmbient,
+    &Params::lightDiffuse,
+    &Params::lightSpecular,
+    &Params::lightSpecularFocus,
+};
+
+/// 'params' with the floats rounded and the granularity dropped, along with
+/// its hash.
+static Params quantize(const Params &params, size_t &hash) {
+    auto key             = params;
+    key.pixelGranularity = 1;
+
+    hash = qHashMulti(
+        0, key.width, key.height, key.materialRed, key.materialGreen,
+        key.materialBlue
+    );
+    for (const auto member : KEY_FLOATS) {
+        auto      &value = key.*member;
+        const auto step  = std::round(value / KEY_STEP);
+        value            = step * KEY_STEP;
+        hash             = qHashMulti(hash, (qint64)step);
+    }
+    return key;
+}
+
+FrameCache::FrameCache(qint64 budgetBytes)
+    : m_entries{}, m_budget{budgetBytes}, m_size{0}, m_hits{0}, m_misses{0} {}
+
+FrameCache::~FrameCache() { clear(); }
+
+qint64 FrameCache::budget() const { return m_budget; }
+
+void FrameCache::setBudget(qint64 bytes) {
+    m_budget = qMax(bytes, 0ll);
+    evict(0);
+}
+
+qint64 FrameCache::size() const { return m_size; }
+
+quint64 FrameCache::hits() const { return m_hits.loadRelaxed(); }
+
+quint64 FrameCache::misses() const { return m_misses.loadRelaxed(); }
+
+const PixelBuffer *FrameCache::find(const Params &params, QRect &hitBounds) {
+    size_t     hash;
+    const auto key = quantize(params, hash);
+    for (qsizetype i = 0; i < m_entries.size(); i++) {
+        const auto entry = m_entries[i];
+        if (entry->hash != hash || entry->key != key)
+            continue;
+        m_entries.move(i, 0);
+        m_hits.fetchAndAddRelaxed(1);
+        hitBounds = entry->hitBounds;
+        return &entry->pixels;
+    }
+    m_misses.fetchAndAddRelaxed(1);
+    return nullptr;
+}
+
+void FrameCache::insert(
+    const Params &params, const PixelBuffer &pixels, const QRect &hitBounds
+) {
+    const auto bytes =
+        (qint64)pixels.stride() * pixels.height() * COLOR_CHANNELS;
+    if (bytes > m_budget)
+        return;
+
+    size_t     hash;
+    const auto key = quantize(params, hash);
+    for (qsizetype i = 0; i < m_entries.size(); i++) {
+        const auto entry = m_entries[i];
+        if (entry->hash == hash && entry->key == key) {
+            m_size -= entry->bytes();
+            delete entry;
+            m_entries.removeAt(i);
+            break;
+        }
+    }
+
+    evict(bytes);
+    auto entry = new Entry{key, hash, {}, hitBounds};
+    entry->pixels.resize(pixels.width(), pixels.height());
+    entry->pixels.copyFrom(pixels);
+    m_entries.prepend(entry);
+    m_size += bytes;
+}
+
+void FrameCache::clear() {
+    for (auto entry : m_entries)
+        delete entry;
+    m_entries.clear();
+    m_size = 0;
+}
+
+void FrameCache::evict(qint64 bytes) {
+    while (!m_entries.isEmpty() && m_size + bytes > m_budget) {
+        const auto entry = m_entries.takeLast();
+        m_size          -= entry->bytes();
+        delete entry;
+    }
+}
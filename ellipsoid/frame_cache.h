@@ -0,0 +1,62 @@
+#ifndef FRAME_CACHE_INCLUDED
+#define FRAME_CACHE_INCLUDED
+
+#include <QAtomicInteger>
+#include <QList>
+#include <QRect>
+
+#include "pixel_buffer.h"
+
+struct Params;
+
+/// Default memory budget of the frame cache, fifteen 1080p frames
+constexpr qint64 DEFAULT_FRAME_CACHE_BYTES = 128ll << 20;
+
+/// Finished full-resolution frames, evicted least recently used first once
+/// they no longer fit the memory budget. Keys are Params with every float
+/// rounded to a fixed step, so that dragging back to an earlier view finds it
+/// despite the rounding the angles picked up along the way. Renderer modes
+/// are no part of the key, the renderer clears the cache when they change.
+class FrameCache {
+public:
+    FrameCache(qint64 budgetBytes);
+    ~FrameCache();
+
+    FrameCache(const FrameCache &)            = delete;
+    FrameCache &operator=(const FrameCache &) = delete;
+
+    qint64 budget() const;
+    /// Evicts frames until the rest fits, 0 disables the cache.
+    void   setBudget(qint64 bytes);
+    /// Bytes held by the cached frames.
+    qint64 size() const;
+
+    /// Thread-safe.
+    quint64 hits() const;
+    /// Thread-safe.
+    quint64 misses() const;
+
+    /// Frame rendered with the same params, whatever their granularity, or
+    /// nullptr. It stays valid until the next insert or setBudget.
+    const PixelBuffer *find(const Params &params, QRect &hitBounds);
+    /// Keeps a copy of 'pixels' unless it alone exceeds the budget.
+    void insert(
+        const Params &params, const PixelBuffer &pixels, const QRect &hitBounds
+    );
+    void clear();
+
+private:
+    struct Entry;
+
+    void evict(qint64 bytes);
+
+    /// Most recently used first
+    QList<Entry *> m_entries;
+    qint64         m_budget;
+    qint64         m_size;
+
+    QAtomicInteger<quint64> m_hits;
+    QAtomicInteger<quint64> m_misses;
+};
+
+#endif // FRAME_CACHE_INCLUDED
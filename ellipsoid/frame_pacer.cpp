@@ -0,0 +1,77 @@
+#include "frame_pacer.h"
+
+constexpr qint64 DEFAULT_BUDGET_NS = 8'000'000;
+
+/// Weight lost by every pass when a new one is recorded
+constexpr double DECAY = 0.2;
+
+FramePacer::FramePacer()
+    : m_budgetNs{DEFAULT_BUDGET_NS}, m_rr{0}, m_rp{0}, m_pp{0}, m_rt{0},
+      m_pt{0}, m_nsPerRay{0}, m_nsPerPixel{0}, m_tracedFraction{1} {}
+
+qint64 FramePacer::budgetNs() const { return m_budgetNs; }
+
+void FramePacer::setBudgetNs(qint64 value) { m_budgetNs = value; }
+
+void FramePacer::record(const RenderStats &stats) {
+    // Shading, warping or copying alone says little about what tracing costs,
+    // and neither do the scattered rays of supersampling
+    if (stats.shadeOnly || stats.cached || stats.samples != 1
+        || stats.raysReprojected > 0 || stats.pixelsWritten == 0)
+        return;
+
+    const double rays   = stats.raysTraced;
+    const double pixels = stats.pixelsWritten;
+    const double time   = stats.durationNs;
+
+    m_rr = m_rr * (1 - DECAY) + rays * rays;
+    m_rp = m_rp * (1 - DECAY) + rays * pixels;
+    m_pp = m_pp * (1 - DECAY) + pixels * pixels;
+    m_rt = m_rt * (1 - DECAY) + rays * time;
+    m_pt = m_pt * (1 - DECAY) + pixels * time;
+    fit();
+
+    const auto samples =
+        stats.raysTraced + stats.raysCulled + stats.raysInterpolated;
+    if (samples > 0)
+        m_tracedFraction = rays / samples;
+}
+
+void FramePacer::fit() {
+    const auto determinant = m_rr * m_pp - m_rp * m_rp;
+    if (determinant > 1e-9 * m_rr * m_pp) {
+        m_nsPerRay   = (m_rt * m_pp - m_pt * m_rp) / determinant;
+        m_nsPerPixel = (m_pt * m_rr - m_rt * m_rp) / determinant;
+        if (m_nsPerRay >= 0 && m_nsPerPixel >= 0)
+            return;
+    }
+
+    // Too few distinct passes so far, or too noisy to tell the costs apart:
+    // charge everything to pixels
+    m_nsPerRay   = 0;
+    m_nsPerPixel = m_pp > 0 ? m_pt / m_pp : 0;
+}
+
+qint64
+FramePacer::predictNs(uint width, uint height, uint granularity) const {
+    const double columns = (width + granularity - 1) / granularity;
+    const double rows    = (height + granularity - 1) / granularity;
+
+    // A chain's first pass writes every pixel and traces the samples the
+    // silhouette does not cull
+    const auto rays = columns * rows * m_tracedFraction;
+    return m_nsPerRay * rays + m_nsPerPixel * width * height;
+}
+
+uint FramePacer::startingGranularity(
+    uint width, uint height, uint coarsest
+) const {
+    if (m_nsPerPixel == 0 && m_nsPerRay == 0)
+        return coarsest;
+
+    auto granularity = coarsest;
+    while (granularity > 1
+           && predictNs(width, height, granularity / 2) <= m_budgetNs)
+        granularity /= 2;
+    return granularity;
+}
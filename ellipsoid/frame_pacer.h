@@ -0,0 +1,45 @@
+#ifndef FRAME_PACER_INCLUDED
+#define FRAME_PACER_INCLUDED
+
+#include "render_stats.h"
+
+/// Learns how long passes take and picks the granularity a progressive chain
+/// starts at, so that the first frame after input lands within the budget.
+///
+/// A pass is modelled as costing a fixed amount per traced ray plus a fixed
+/// amount per written pixel. Both are fitted by least squares over the
+/// passes seen so far, with older passes weighing less and less.
+class FramePacer {
+public:
+    FramePacer();
+
+    qint64 budgetNs() const;
+    void   setBudgetNs(qint64 value);
+
+    void record(const RenderStats &stats);
+
+    /// Duration of a pass starting a chain, 0 while nothing is known.
+    qint64 predictNs(uint width, uint height, uint granularity) const;
+
+    /// Finest granularity reachable from 'coarsest' by halving whose pass is
+    /// predicted to fit the budget, 'coarsest' if none does.
+    uint startingGranularity(uint width, uint height, uint coarsest) const;
+
+private:
+    /// Solves the weighted normal equations for the per-ray and per-pixel
+    /// costs.
+    void fit();
+
+    qint64 m_budgetNs;
+
+    // Exponentially weighted sums over the recorded passes, with r rays
+    // traced, p pixels written and t nanoseconds taken
+    double m_rr, m_rp, m_pp, m_rt, m_pt;
+
+    double m_nsPerRay;
+    double m_nsPerPixel;
+    /// Share of samples that needed a ray in the latest pass
+    double m_tracedFraction;
+};
+
+#endif // FRAME_PACER_INCLUDED
@@ -0,0 +1,412 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <utility>
+
+#include <QVarLengthArray>
+
+#include "instance_bvh.h"
+
+/// Parent of the root
+constexpr uint NO_PARENT = UINT_MAX;
+
+/// Side of the box instanceLattice fills, that of the default ellipsoid's
+/// longest axis
+constexpr float LATTICE_EXTENT = 8.f;
+
+/// Golden angle, rotations by its multiples never line up
+constexpr float LATTICE_TURN = 2.3999632f;
+
+QList<Instance> instanceLattice(uint count) {
+    uint side = 1;
+    while (side * side * side < count)
+        side++;
+    const auto spacing = LATTICE_EXTENT / side;
+    const auto offset  = (side - 1) / 2.f;
+
+    QList<Instance> res;
+    res.reserve(count);
+    for (uint i = 0; i < count; i++) {
+        const auto x = (i % side - offset) * spacing;
+        const auto y = (i / side % side - offset) * spacing;
+        const auto z = (i / (side * side) - offset) * spacing;
+        res.append(
+            {PMat4::translation(x, y, z) * PMat4::rotationY(i * LATTICE_TURN)
+             * PMat4::rotationX(i * LATTICE_TURN / 2)
+             * PMat4::scaling(spacing / 2, spacing / 4, spacing / 8)}
+        );
+    }
+    return res;
+}
+
+InstanceBvh::Box InstanceBvh::Box::empty() {
+    return {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+}
+
+void InstanceBvh::Box::extend(const Box &other) {
+    for (uint a = 0; a < 3; a++) {
+        min[a] = qMin(min[a], other.min[a]);
+        max[a] = qMax(max[a], other.max[a]);
+    }
+}
+
+float InstanceBvh::Box::area() const {
+    const auto x = max[0] - min[0];
+    const auto y = max[1] - min[1];
+    const auto z = max[2] - min[2];
+    return x * y + y * z + z * x;
+}
+
+float InstanceBvh::Box::centre(uint axis) const {
+    return (min[axis] + max[axis]) / 2;
+}
+
+InstanceBvh::InstanceBvh()
+    : m_instances{}, m_inverses{}, m_boxes{}, m_nodes{}, m_order{},
+      m_leafOf{}, m_depth{0} {}
+
+bool InstanceBvh::isEmpty() const { return m_instances.isEmpty(); }
+
+uint InstanceBvh::size() const { return m_instances.size(); }
+
+uint InstanceBvh::nodeCount() const { return m_nodes.size(); }
+
+uint InstanceBvh::depth() const { return m_depth; }
+
+const Instance &InstanceBvh::instance(uint index) const {
+    return m_instances[index];
+}
+
+bool InstanceBvh::bounds(PVec4 &min, PVec4 &max) const {
+    if (m_nodes.isEmpty())
+        return false;
+    const auto &box = m_nodes[0].box;
+    min             = {box.min[0], box.min[1], box.min[2]};
+    max             = {box.max[0], box.max[1], box.max[2]};
+    return true;
+}
+
+void InstanceBvh::build(
+    const QList<Instance> &instances, TileScheduler &scheduler
+) {
+    clear();
+    const uint count = instances.size();
+    if (count == 0)
+        return;
+
+    m_instances = instances;
+    m_inverses.resize(count);
+    m_boxes.resize(count);
+    m_order.resize(count);
+    m_leafOf.resize(count);
+    for (uint i = 0; i < count; i++) {
+        m_inverses[i] = instances[i].model.inverse();
+        m_boxes[i]    = bounds(instances[i].model);
+        m_order[i]    = i;
+    }
+
+    // The top levels split ranges of all instances, one after another, until
+    // there are enough subtrees to keep every worker busy
+    m_nodes.append({Box::empty(), 0, 0, NO_PARENT});
+    QList<Range> subtrees{{0, 0, count}};
+    const auto   target = scheduler.threadCount() * BVH_SUBTREES_PER_THREAD;
+    while (!subtrees.isEmpty() && (uint)subtrees.size() < target) {
+        QList<Range> next;
+        for (const auto &range : subtrees)
+            expand(range, m_nodes, next);
+        subtrees = next;
+    }
+
+    // Subtrees cover disjoint ranges of m_order, tiles merely number them
+    QList<QList<Node>> built(subtrees.size());
+    QList<Tile>        tiles;
+    for (uint i = 0; i < (uint)subtrees.size(); i++)
+        tiles.append({i, 0, 1, 1});
+    scheduler.run(tiles, [this, &subtrees, &built](const Tile &tile) {
+        const auto &range = subtrees[tile.x];
+        buildSubtree(range.begin, range.end, built[tile.x]);
+    });
+
+    // Every subtree root takes the place of its range's node, the rest are
+    // appended, which keeps children after their parents
+    for (uint i = 0; i < (uint)subtrees.size(); i++) {
+        const auto &nodes = built[i];
+        const auto  slot  = subtrees[i].node;
+        const auto  base  = (uint)m_nodes.size() - 1;
+        const auto  map   = [slot, base](uint local) {
+            return local == 0 ? slot : base + local;
+        };
+        for (uint j = 0; j < (uint)nodes.size(); j++) {
+            auto node   = nodes[j];
+            node.parent = j == 0 ? m_nodes[slot].parent : map(node.parent);
+            if (node.count == 0)
+                node.first = map(node.first);
+            if (j == 0)
+                m_nodes[slot] = node;
+            else
+                m_nodes.append(node);
+        }
+    }
+
+    QList<uint> depths(m_nodes.size());
+    for (uint i = 0; i < (uint)m_nodes.size(); i++) {
+        const auto &node = m_nodes[i];
+        depths[i] = node.parent == NO_PARENT ? 1 : depths[node.parent] + 1;
+        m_depth   = qMax(m_depth, depths[i]);
+        for (uint j = 0; j < node.count; j++)
+            m_leafOf[m_order[node.first + j]] = i;
+    }
+}
+
+void InstanceBvh::refit(uint index, const Instance &instance) {
+    m_instances[index] = instance;
+    m_inverses[index]  = instance.model.inverse();
+    m_boxes[index]     = bounds(instance.model);
+
+    auto  current = m_leafOf[index];
+    auto &leaf    = m_nodes[current];
+    leaf.box      = Box::empty();
+    for (uint i = 0; i < leaf.count; i++)
+        leaf.box.extend(m_boxes[m_order[leaf.first + i]]);
+    while ((current = m_nodes[current].parent) != NO_PARENT) {
+        auto &node = m_nodes[current];
+        node.box   = m_nodes[node.first].box;
+        node.box.extend(m_nodes[node.first + 1].box);
+    }
+}
+
+void InstanceBvh::clear() {
+    m_instances.clear();
+    m_inverses.clear();
+    m_boxes.clear();
+    m_nodes.clear();
+    m_order.clear();
+    m_leafOf.clear();
+    m_depth = 0;
+}
+
+InstanceBvh::Box InstanceBvh::bounds(const PMat4 &model) {
+    // Extent of the transformed unit sphere along every world axis
+    Box res;
+    for (uint a = 0; a < 3; a++) {
+        const auto extent = std::sqrt(
+            model[{a, 0}] * model[{a, 0}] + model[{a, 1}] * model[{a, 1}]
+            + model[{a, 2}] * model[{a, 2}]
+        );
+        res.min[a] = model[{a, 3}] - extent;
+        res.max[a] = model[{a, 3}] + extent;
+    }
+    return res;
+}
+
+uint InstanceBvh::split(uint begin, uint end, Box &box) {
+    box            = Box::empty();
+    auto centroids = Box::empty();
+    for (uint i = begin; i < end; i++) {
+        const auto &instanceBox = m_boxes[m_order[i]];
+        box.extend(instanceBox);
+        for (uint a = 0; a < 3; a++) {
+            centroids.min[a] = qMin(centroids.min[a], instanceBox.centre(a));
+            centroids.max[a] = qMax(centroids.max[a], instanceBox.centre(a));
+        }
+    }
+    if (end - begin <= BVH_LEAF_SIZE)
+        return end;
+
+    uint axis = 0;
+    for (uint a = 1; a < 3; a++)
+        if (centroids.max[a] - centroids.min[a]
+            > centroids.max[axis] - centroids.min[axis])
+            axis = a;
+    const auto low    = centroids.min[axis];
+    const auto extent = centroids.max[axis] - low;
+    if (!(extent > 0))
+        return end;
+
+    const auto binOf = [this, axis, low, extent](uint instance) {
+        const auto position = m_boxes[instance].centre(axis) - low;
+        return qMin((uint)(position / extent * BVH_BINS), BVH_BINS - 1);
+    };
+    Box  bins[BVH_BINS];
+    uint counts[BVH_BINS] = {};
+    for (auto &bin : bins)
+        bin = Box::empty();
+    for (uint i = begin; i < end; i++) {
+        const auto bin = binOf(m_order[i]);
+        bins[bin].extend(m_boxes[m_order[i]]);
+        counts[bin]++;
+    }
+
+    // Cost of every split before bin i, the lowest and the highest centroid
+    // fall into the first and last bin, so some split leaves neither half
+    // empty
+    float rightCosts[BVH_BINS];
+    auto  right      = Box::empty();
+    uint  rightCount = 0;
+    for (uint i = BVH_BINS - 1; i > 0; i--) {
+        right.extend(bins[i]);
+        rightCount    += counts[i];
+        rightCosts[i]  = rightCount == 0 ? INFINITY : rightCount * right.area();
+    }
+    auto  left      = Box::empty();
+    uint  leftCount = 0;
+    uint  best      = 1;
+    float bestCost  = INFINITY;
+    for (uint i = 1; i < BVH_BINS; i++) {
+        left.extend(bins[i - 1]);
+        leftCount += counts[i - 1];
+        if (leftCount == 0)
+            continue;
+        const auto cost = leftCount * left.area() + rightCosts[i];
+        if (cost < bestCost) {
+            bestCost = cost;
+            best     = i;
+        }
+    }
+
+    const auto middle = std::partition(
+        m_order.begin() + begin, m_order.begin() + end,
+        [&binOf, best](uint instance) { return binOf(instance) < best; }
+    );
+    return middle - m_order.begin();
+}
+
+void InstanceBvh::buildSubtree(uint begin, uint end, QList<Node> &nodes) {
+    nodes.append({Box::empty(), 0, 0, NO_PARENT});
+    QList<Range> ranges{{0, begin, end}};
+    while (!ranges.isEmpty())
+        expand(ranges.takeLast(), nodes, ranges);
+}
+
+void InstanceBvh::expand(
+    const Range &range, QList<Node> &nodes, QList<Range> &ranges
+) {
+    Box        box;
+    const auto middle = split(range.begin, range.end, box);
+    const uint first  = nodes.size();
+
+    auto &node = nodes[range.node];
+    node.box   = box;
+    if (middle == range.end) {
+        node.first = range.begin;
+        node.count = range.end - range.begin;
+        return;
+    }
+    node.first = first;
+    node.count = 0;
+    nodes.append({Box::empty(), 0, 0, range.node});
+    nodes.append({Box::empty(), 0, 0, range.node});
+    ranges.append({first, range.begin, middle});
+    ranges.append({first + 1, middle, range.end});
+}
+
+bool InstanceBvh::intersect(
+    const PVec4 &origin, const PVec4 &direction, float &distance,
+    PVec4 &normal
+) const {
+    if (m_nodes.isEmpty())
+        return false;
+
+    const float o[]       = {origin.x, origin.y, origin.z};
+    const float d[]       = {direction.x, direction.y, direction.z};
+    const float inverse[] = {1 / d[0], 1 / d[1], 1 / d[2]};
+
+    // Distance at which the ray enters a box, or 'limit' if it misses it.
+    // Axes the ray runs along give NaN at the slabs' planes, which the
+    // argument order of qMax and qMin skips.
+    const auto enter = [&o, &inverse](const Box &box, float limit) {
+        float near = 0;
+        float far  = limit;
+        for (uint a = 0; a < 3; a++) {
+            auto t0 = (box.min[a] - o[a]) * inverse[a];
+            auto t1 = (box.max[a] - o[a]) * inverse[a];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            near = qMax(near, t0);
+            far  = qMin(t1, far);
+        }
+        return near <= far ? near : limit;
+    };
+
+    // Nearer children are visited first, so that farther ones are more
+    // likely to lie behind the nearest hit by the time they are popped
+    float                                       limit = INFINITY;
+    QVarLengthArray<std::pair<uint, float>, 64> stack;
+    if (enter(m_nodes[0].box, limit) < limit)
+        stack.append({0, 0});
+    while (!stack.isEmpty()) {
+        const auto [index, entry] = stack.takeLast();
+        if (entry >= limit)
+            continue;
+
+        const auto &node = m_nodes[index];
+        if (node.count > 0) {
+            for (uint i = 0; i < node.count; i++)
+                limit = intersectInstance(
+                    m_order[node.first + i], o, d, limit, normal
+                );
+            continue;
+        }
+
+        auto near      = node.first;
+        auto far       = node.first + 1;
+        auto nearEntry = enter(m_nodes[near].box, limit);
+        auto farEntry  = enter(m_nodes[far].box, limit);
+        if (farEntry < nearEntry) {
+            std::swap(near, far);
+            std::swap(nearEntry, farEntry);
+        }
+        if (farEntry < limit)
+            stack.append({far, farEntry});
+        if (nearEntry < limit)
+            stack.append({near, nearEntry});
+    }
+
+    distance = limit;
+    return limit < INFINITY;
+}
+
+float InstanceBvh::intersectInstance(
+    uint index, const float *origin, const float *direction, float limit,
+    PVec4 &normal
+) const {
+    const auto &m = m_inverses[index];
+    float       o[3], d[3];
+    for (uint i = 0; i < 3; i++) {
+        o[i] = m[{i, 0}] * origin[0] + m[{i, 1}] * origin[1]
+             + m[{i, 2}] * origin[2] + m[{i, 3}];
+        d[i] = m[{i, 0}] * direction[0] + m[{i, 1}] * direction[1]
+             + m[{i, 2}] * direction[2];
+    }
+
+    // Against the unit sphere, from the point of the ray closest to its
+    // centre rather than from b^2 - 4ac, which loses most of its digits for
+    // small instances far away
+    const auto a       = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    const auto closest = -(o[0] * d[0] + o[1] * d[1] + o[2] * d[2]) / a;
+    float      p[3];
+    for (uint i = 0; i < 3; i++)
+        p[i] = o[i] + d[i] * closest;
+    const auto inside = 1 - (p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    if (inside < 0)
+        return limit;
+
+    // The far side when the ray starts inside
+    const auto half = std::sqrt(inside / a);
+    auto       t    = closest - half;
+    if (t <= 0)
+        t = closest + half;
+    if (t <= 0 || t >= limit)
+        return limit;
+
+    // The gradient of the sphere is the point itself, the inverse transpose
+    // takes it to world space
+    for (uint i = 0; i < 3; i++)
+        p[i] = o[i] + d[i] * t;
+    normal = {
+        m[{0, 0}] * p[0] + m[{1, 0}] * p[1] + m[{2, 0}] * p[2],
+        m[{0, 1}] * p[0] + m[{1, 1}] * p[1] + m[{2, 1}] * p[2],
+        m[{0, 2}] * p[0] + m[{1, 2}] * p[1] + m[{2, 2}] * p[2], 0
+    };
+    return t;
+}
@@ -0,0 +1,128 @@
+#ifndef INSTANCE_BVH_INCLUDED
+#define INSTANCE_BVH_INCLUDED
+
+#include <QList>
+
+#include "../pmath.h"
+#include "tile_scheduler.h"
+
+/// Instances a leaf holds at most, unless they all share a centroid.
+constexpr uint BVH_LEAF_SIZE = 4;
+
+/// Buckets along the split axis between which the surface area heuristic
+/// chooses, instead of trying every instance.
+constexpr uint BVH_BINS = 16;
+
+/// Subtrees handed to every worker of a parallel build, so that the uneven
+/// ones even out.
+constexpr uint BVH_SUBTREES_PER_THREAD = 4;
+
+/// One ellipsoid of a scene, 'model' maps the unit sphere onto it and must
+/// be affine and invertible.
+struct Instance {
+    PMat4 model;
+};
+
+/// 'count' ellipsoids on a cubic lattice filling the same box the default
+/// ellipsoid does. They share its 4:2:1 semi-axes, rotated differently for
+/// every instance but the first, so that a single one is that ellipsoid.
+QList<Instance> instanceLattice(uint count);
+
+/// Bounding volume hierarchy over the world-space boxes of instances, to
+/// trace a ray past all but the few it may hit. Every instance is
+/// intersected in its own space, where it is the unit sphere.
+class InstanceBvh {
+public:
+    InstanceBvh();
+
+    bool isEmpty() const;
+    uint size() const;
+    uint nodeCount() const;
+    /// Longest path from the root to a leaf, a single leaf has depth 1.
+    uint depth() const;
+
+    const Instance &instance(uint index) const;
+    /// World-space box around every instance, false if there are none.
+    bool            bounds(PVec4 &min, PVec4 &max) const;
+
+    /// Builds the hierarchy anew, the subtrees below the top few levels in
+    /// parallel on 'scheduler'.
+    void build(const QList<Instance> &instances, TileScheduler &scheduler);
+    /// Replaces one instance and refits the boxes from its leaf up to the
+    /// root. The tree is kept as it is, so traversal slows down the further
+    /// instances wander from where they were at the last build.
+    void refit(uint index, const Instance &instance);
+    void clear();
+
+    /// Nearest hit in front of 'origin' along 'direction', both in world
+    /// space, with 'distance' in multiples of 'direction' and 'normal' the
+    /// outward normal, not normalized. Returns false on a miss.
+    bool intersect(
+        const PVec4 &origin, const PVec4 &direction, float &distance,
+        PVec4 &normal
+    ) const;
+
+private:
+    struct Box {
+        float min[3];
+        float max[3];
+
+        static Box empty();
+        void       extend(const Box &other);
+        /// Half the surface area
+        float      area() const;
+        float      centre(uint axis) const;
+    };
+
+    struct Node {
+        Box  box;
+        /// First of two consecutive children of inner nodes, first entry of
+        /// m_order covered by leaves
+        uint first;
+        /// Instances of leaves, 0 for inner nodes
+        uint count;
+        uint parent;
+    };
+
+    /// Entries of m_order a node is yet to be built from.
+    struct Range {
+        uint node;
+        uint begin;
+        uint end;
+    };
+
+    /// World-space box of the instance with that model.
+    static Box bounds(const PMat4 &model);
+
+    /// Gives 'node' the box of m_order[begin, end) and partitions that range
+    /// between its two halves with the surface area heuristic. Returns where
+    /// the second half starts, or 'end' if the node stays a leaf.
+    uint split(uint begin, uint end, Box &box);
+    /// Builds the tree over m_order[begin, end) into 'nodes', root first,
+    /// with node indices local to it.
+    void buildSubtree(uint begin, uint end, QList<Node> &nodes);
+    /// Makes the node at range.node a leaf or appends its two children to
+    /// 'nodes' and their ranges to 'ranges'.
+    void expand(const Range &range, QList<Node> &nodes, QList<Range> &ranges);
+
+    /// Hit distance along the ray if it is in front of 'origin' and closer
+    /// than 'limit', otherwise 'limit'.
+    float intersectInstance(
+        uint index, const float *origin, const float *direction, float limit,
+        PVec4 &normal
+    ) const;
+
+    QList<Instance> m_instances;
+    /// World to instance space
+    QList<PMat4>    m_inverses;
+    QList<Box>      m_boxes;
+
+    QList<Node> m_nodes;
+    /// Instance indices, every leaf covers a contiguous range of them
+    QList<uint> m_order;
+    /// Leaf of every instance
+    QList<uint> m_leafOf;
+    uint        m_depth;
+};
+
+#endif // INSTANCE_BVH_INCLUDED
@@ -0,0 +1,18 @@
+#include <cstring>
+
+#include "pixel_buffer.h"
+
+void PixelBuffer::resize(uint width, uint height) {
+    if (StridedBuffer::resize(width, height))
+        memset(data(), 0, size() * sizeof(Pixel));
+}
+
+void PixelBuffer::copyFrom(const PixelBuffer &other) {
+    memcpy(data(), other.constData(), size() * sizeof(Pixel));
+}
+
+uchar *PixelBuffer::data() { return (uchar *)row(0); }
+
+const uchar *PixelBuffer::constData() const {
+    return (const uchar *)constRow(0);
+}
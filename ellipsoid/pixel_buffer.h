@@ -0,0 +1,97 @@
+#ifndef PIXEL_BUFFER_INCLUDED
+#define PIXEL_BUFFER_INCLUDED
+
+#include <QImage>
+#include <QtGlobal>
+#include <qopengl.h>
+
+#include "../math/ppacket.h"
+#include "strided_buffer.h"
+
+/// All channels of a pixel, written with a single store.
+typedef quint32 Pixel;
+
+/// Order of the channels of a Pixel in memory, whatever the byte order of
+/// the host. Frames are uploaded and saved straight from that memory.
+enum class PixelFormat {
+    Rgba8,
+};
+
+/// Byte of a Pixel in memory each 8-bit channel lies in, and the formats
+/// GL and QImage take that memory in.
+struct PixelFormatTraits {
+    uint           redByte;
+    uint           greenByte;
+    uint           blueByte;
+    uint           alphaByte;
+    /// Texture upload format and type.
+    GLenum         glFormat;
+    GLenum         glType;
+    QImage::Format imageFormat;
+};
+
+/// Indexed by PixelFormat.
+constexpr PixelFormatTraits PIXEL_FORMAT_TRAITS[] = {
+    {0, 1, 2, 3, GL_RGBA, GL_UNSIGNED_BYTE, QImage::Format_RGBA8888},
+};
+
+/// Format of every PixelBuffer.
+constexpr PixelFormat       PIXEL_BUFFER_FORMAT = PixelFormat::Rgba8;
+constexpr PixelFormatTraits PIXEL_BUFFER_TRAITS =
+    PIXEL_FORMAT_TRAITS[(int)PIXEL_BUFFER_FORMAT];
+
+constexpr uint COLOR_CHANNELS   = sizeof(Pixel);
+constexpr uint CACHE_LINE_BYTES = 64;
+/// Pixels sharing a cache line, tile widths are kept a multiple of this.
+constexpr uint CACHE_LINE_PIXELS = CACHE_LINE_BYTES / COLOR_CHANNELS;
+
+/// Bits to shift a channel by to put it in byte 'byte' of a Pixel in memory.
+constexpr uint channelShift(uint byte) {
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    return byte * 8;
+#else
+    return (COLOR_CHANNELS - 1 - byte) * 8;
+#endif
+}
+
+/// 8-bit channels in PIXEL_BUFFER_FORMAT.
+constexpr Pixel packPixel(uint r, uint g, uint b, uint a = 255) {
+    const auto &format = PIXEL_BUFFER_TRAITS;
+    return r << channelShift(format.redByte)
+         | g << channelShift(format.greenByte)
+         | b << channelShift(format.blueByte)
+         | a << channelShift(format.alphaByte);
+}
+
+constexpr Pixel BACKGROUND_PIXEL = packPixel(0, 0, 0);
+
+/// Sets 'count' pixels from 'dst' on, a packet's worth of them per store.
+inline void fillPixels(Pixel *dst, uint count, Pixel value) {
+#if defined(PPACKET_AVX2)
+    const auto wide = _mm256_set1_epi32(value);
+    for (; count >= 8; count -= 8, dst += 8)
+        _mm256_storeu_si256((__m256i *)dst, wide);
+#elif defined(PPACKET_SSE2)
+    const auto wide = _mm_set1_epi32(value);
+    for (; count >= 4; count -= 4, dst += 4)
+        _mm_storeu_si128((__m128i *)dst, wide);
+#endif
+    for (; count > 0; count--)
+        *dst++ = value;
+}
+
+/// Image of packed pixels whose rows start on cache line boundaries, so that
+/// threads filling different tiles never write to the same cache line.
+class PixelBuffer : public StridedBuffer<Pixel, CACHE_LINE_PIXELS> {
+public:
+    /// A new size clears every pixel to 0.
+    void resize(uint width, uint height);
+    /// Both buffers must have the same size.
+    void copyFrom(const PixelBuffer &other);
+
+    /// Every row in PIXEL_BUFFER_FORMAT, stride() pixels apart.
+    uchar       *data();
+    const uchar *constData() const;
+};
+
+#endif // PIXEL_BUFFER_INCLUDED
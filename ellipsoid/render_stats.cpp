@@ -0,0 +1,3 @@
+#include "render_stats.h"
+
+Q_LOGGING_CATEGORY(lcRenderStats, "ellipsoid.stats", QtWarningMsg)
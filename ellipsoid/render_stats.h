@@ -0,0 +1,115 @@
+#ifndef RENDER_STATS_INCLUDED
+#define RENDER_STATS_INCLUDED
+
+#include <QList>
+#include <QLoggingCategory>
+#include <QRect>
+#include <QString>
+
+/// Enable with QT_LOGGING_RULES="ellipsoid.stats.debug=true"
+Q_DECLARE_LOGGING_CATEGORY(lcRenderStats)
+
+/// Summary of a single completed pass, emitted with Renderer::renderCompleted
+/// and completed by the view once the pass is on screen.
+struct RenderStats {
+    quint64 generation;
+    uint    pixelGranularity;
+    /// From dispatching the first tile to finishing the last one.
+    qint64  durationNs;
+    /// Shaded from the geometry of the previous pass, nothing was traced.
+    bool    shadeOnly;
+    /// Presented from the frame cache, nothing was traced or shaded.
+    bool    cached;
+    /// Samples averaged into every pixel along the silhouette, more than 1
+    /// for Renderer::supersample passes and 0 if they found nothing to refine.
+    uint    samples;
+
+    /// Rays traced by this pass alone.
+    quint64 raysTraced;
+    /// Traced rays that hit the ellipsoid.
+    quint64 raysHit;
+    /// Samples of this pass outside the silhouette, filled without tracing.
+    quint64 raysCulled;
+    /// Samples of this pass interpolated by adaptive refinement.
+    quint64 raysInterpolated;
+    /// Pixels of this pass warped from the previous frame instead of traced.
+    quint64 raysReprojected;
+    /// Pixels filled by this pass, the rest were kept from the previous one.
+    quint64 pixelsWritten;
+    /// Rays traced since the last pass that could not build on its
+    /// predecessor, i.e. by the whole progressive chain so far.
+    quint64 chainRaysTraced;
+
+    /// Pixels that may differ from the previous completed pass, the whole
+    /// frame if there is none or its size was different.
+    QRect dirtyRect;
+
+    /// Time every worker thread spent on tiles of this pass, empty if nothing
+    /// was dispatched to them.
+    QList<qint64> threadBusyNs;
+    /// Part of threadBusyNs, summed over the threads, spent writing finished
+    /// colours to the pixel buffer rather than tracing and shading them.
+    qint64        pixelWriteNs;
+
+    /// Bytes uploaded to the texture for this pass, including tiles streamed
+    /// while it ran. 0 until presented.
+    qint64 uploadBytes;
+    /// From requesting the pass to presenting it, queueing on the render
+    /// thread included. -1 until presented.
+    qint64 latencyNs;
+
+    /// Share of this pass' samples that were culled, from 0 to 1.
+    double culledFraction() const {
+        const auto samples =
+            raysTraced + raysCulled + raysInterpolated + raysReprojected;
+        return samples > 0 ? (double)raysCulled / samples : 0.;
+    }
+    /// Share of the traced rays that hit, from 0 to 1.
+    double hitFraction() const {
+        return raysTraced > 0 ? (double)raysHit / raysTraced : 0.;
+    }
+    /// Share of durationNs the worker threads spent on tiles, from 0 to 1.
+    double busyFraction() const {
+        qint64 busyNs = 0;
+        for (const auto ns : threadBusyNs)
+            busyNs += ns;
+        const auto available = (double)durationNs * threadBusyNs.size();
+        return available > 0 ? qMin(busyNs / available, 1.) : 0.;
+    }
+
+    operator QString() const {
+        auto res = QString("Pass:%1 granularity:%2%3 time:%4ms rays:%5 "
+                           "hit:%6% culled:%7% interpolated:%8 "
+                           "reprojected:%9 chain rays:%10 busy:%11% "
+                           "write:%12ms dirty:%13x%14+%15+%16")
+            .arg(
+                QString::number(generation), QString::number(pixelGranularity),
+                shadeOnly ? QString(" (shade only)")
+                : cached  ? QString(" (cached)")
+                : samples != 1
+                    ? QString(" (%1 samples)").arg(samples)
+                    : QString(),
+                QString::number(durationNs / 1e6, 'f', 2),
+                QString::number(raysTraced),
+                QString::number(hitFraction() * 100, 'f', 1),
+                QString::number(culledFraction() * 100, 'f', 1),
+                QString::number(raysInterpolated),
+                QString::number(raysReprojected),
+                QString::number(chainRaysTraced),
+                QString::number(busyFraction() * 100, 'f', 1),
+                QString::number(pixelWriteNs / 1e6, 'f', 2),
+                QString::number(dirtyRect.width()),
+                QString::number(dirtyRect.height()),
+                QString::number(dirtyRect.x()), QString::number(dirtyRect.y())
+            );
+        if (latencyNs >= 0)
+            res += QString(" upload:%1B latency:%2ms")
+                       .arg(
+                           QString::number(uploadBytes),
+                           QString::number(latencyNs / 1e6, 'f', 2)
+                       );
+        return res;
+    }
+};
+
+#endif // RENDER_STATS_INCLUDED
@@ -1,97 +1,244 @@
-#include <QtConcurrent>
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <utility>
+
+#include <QVarLengthArray>
 
-#include "ellipsoid.h"
 #include "renderer.h"
+#include "streaming_image_writer.h"
 
-constexpr qint64 FRAME_INTERVAL_MS = 10;
+constexpr uint DEFAULT_TILE_WIDTH  = 64;
+constexpr uint DEFAULT_TILE_HEIGHT = 16;
 
-struct Position2D {
-    uint x = 0, y = 0;
+/// Largest intensity difference between the corners of a block that adaptive
+/// refinement still interpolates over, about 4 colour levels
+constexpr float ADAPTIVE_THRESHOLD = 4.f / 255;
 
-    operator QString() const {
-        return QString("Pixel:%1,%2")
-            .arg(QString::number(x), QString::number(y));
-    }
-};
+/// Points compared with powf between two entries of the specular table
+constexpr uint SPECULAR_ERROR_SAMPLES = 8;
 
-class ScreenIterator2D : Position2D {
-    static constexpr uint PAST_THE_END = (uint)-1;
+/// Steps of the R2 sequence, the reciprocals of the plastic number and of
+/// its square. Its points cover the unit square evenly however many of them
+/// are taken.
+constexpr double R2_STEP_X = 0.7548776662466927;
+constexpr double R2_STEP_Y = 0.5698402909980532;
 
-    uint width, height, step;
+/// Rounding error bound of a single-precision ray discriminant, relative to
+/// the magnitude of its terms
+constexpr double ROUNDING_ULPS = 8;
 
-    ScreenIterator2D(
-        uint w, uint h, uint s, uint startingX = 0, uint startingY = 0
-    )
-        : Position2D{startingX, startingY}, width{w}, height{h}, step{s} {}
+/// Sample colours a row stages on the stack, those of wider rows go to the
+/// heap
+constexpr uint ROW_SAMPLES = 256;
 
-public:
-    typedef int                       difference_type;
-    typedef Position2D                value_type;
-    typedef void                      pointer;
-    typedef void                      reference;
-    typedef std::forward_iterator_tag iterator_category;
+/// Staged for pixels a row leaves as they are, every colour is opaque
+constexpr Pixel KEEP_PIXEL = 0;
 
-    inline static ScreenIterator2D begin(uint w, uint h, uint s) {
-        return ScreenIterator2D{w, h, s};
-    }
+/// Nearer root of a * z^2 + b * z + c = 0, the depth at which a ray hits the
+/// quadric. Returns false if it misses.
+template <typename Real>
+static bool nearerRoot(Real a, Real b, Real c, float &z) {
+    const auto delta = b * b - 4 * a * c;
+    if (delta < 0)
+        return false;
 
-    inline static ScreenIterator2D end(uint w, uint h, uint s) {
-        return ScreenIterator2D{w, h, s, PAST_THE_END, PAST_THE_END};
-    }
+    const auto root = std::sqrt(delta);
+    z               = qMin((-b - root) / (2 * a), (-b + root) / (2 * a));
+    return true;
+}
 
-    operator QString() const {
-        return QString("Iterator:%1/%3,%2/%4+%5")
-            .arg(
-                QString::number(x), QString::number(y), QString::number(width),
-                QString::number(height), QString::number(step)
-            );
-    }
+/// Whether the float discriminant of b and c is within its rounding error of
+/// 0, where its sign cannot be trusted.
+static bool nearZero(float a, float b, float c) {
+    const auto delta = b * b - 4 * a * c;
+    const auto error = (float)(ROUNDING_ULPS * FLT_EPSILON)
+                     * (b * b + 4 * std::abs(a) * std::abs(c));
+    return std::abs(delta) < error;
+}
 
-    inline bool operator==(const ScreenIterator2D &other) const {
-        return x == other.x && y == other.y;
-    }
-    inline bool operator!=(const ScreenIterator2D &other) const {
-        return !(*this == other);
+static Pixel shadePixel(uint r, uint g, uint b, float intensity) {
+    return packPixel(
+        (uint)(r * intensity), (uint)(g * intensity), (uint)(b * intensity)
+    );
+}
+
+/// Fills rows [yBegin, yEnd) from the staged colours of 'count' samples
+/// 'step' pixels apart from xBegin on, every one over 'blockSize' pixels but
+/// not past xEnd. Neighbouring blocks of the same colour are filled at once.
+/// Returns the pixels written.
+static quint64 writeSamples(
+    PixelBuffer &pixels, uint yBegin, uint yEnd, uint xBegin, uint xEnd,
+    uint step, uint blockSize, const Pixel *colours, uint count
+) {
+    quint64 written = 0;
+    for (uint k = 0; k < count;) {
+        const auto colour = colours[k];
+        auto       next   = k + 1;
+        if (blockSize == step)
+            while (next < count && colours[next] == colour)
+                next++;
+        if (colour != KEEP_PIXEL) {
+            const auto x    = xBegin + k * step;
+            const auto last = xBegin + (next - 1) * step;
+            const auto end  = qMin(last + blockSize, xEnd);
+            written        += (quint64)(end - x) * (yEnd - yBegin);
+            for (uint y = yBegin; y < yEnd; y++)
+                fillPixels(pixels.row(y) + x, end - x, colour);
+        }
+        k = next;
     }
+    return written;
+}
 
-    inline Position2D operator*() { return *this; }
+Renderer::Renderer()
+    : QObject(nullptr), m_newestGeneration{0}, m_newestExport{0},
+      m_kernel{Kernel::Packet}, m_specular{Specular::Exact},
+      m_precision{Precision::Mixed}, m_adaptive{false}, m_reprojection{true},
+      m_scheduler{(uint)QThread::idealThreadCount()},
+      m_tileOrder{TileOrder::RowMajor}, m_tileWidth{DEFAULT_TILE_WIDTH},
+      m_tileHeight{DEFAULT_TILE_HEIGHT}, m_timer{}, m_pvme{}, m_pvInverse{},
+      m_coefficients{}, m_instances{}, m_instanceRect{}, m_specularTable{},
+      m_specularTableFocus{NAN}, m_specularTableError{0}, m_frames{},
+      m_surfaces{}, m_framesResizeCount{0}, m_lastPass{},
+      m_lastPassValid{false}, m_chainRaysTraced{0}, m_lastHitBounds{},
+      m_lastFrameSize{}, m_latestFrame{}, m_latestBuffer{nullptr}, m_latestPv{},
+      m_latestCamera{}, m_latestReprojected{false}, m_toLatest{},
+      m_latestCameraPlane{}, m_reprojectionSource{}, m_accumulation{},
+      m_samples{0}, m_edgeTiles{}, m_edgeBounds{},
+      m_frameCache{DEFAULT_FRAME_CACHE_BYTES}, m_lastLookup{} {}
+Renderer::~Renderer() { m_timer.invalidate(); }
 
-    inline ScreenIterator2D &operator++() {
-        x += step;
-        if (x < width)
-            return *this;
-        x  = 0;
-        y += step;
-        if (y < height)
-            return *this;
-        x = PAST_THE_END;
-        y = PAST_THE_END;
-        return *this;
-    }
-    inline ScreenIterator2D operator++(int) {
-        const auto copy = *this;
-        ++(*this);
-        return copy;
-    }
-};
+FrameBuffers &Renderer::frames() { return m_frames; }
 
-Renderer::Renderer(Ellipsoid *ellipsoid)
-    : QObject(nullptr), m_timer{}, m_pvme{}, m_pvInverse{},
-      m_ellipsoid{ellipsoid} {
-    m_timer.start();
+const FrameCache &Renderer::frameCache() const { return m_frameCache; }
+
+const QuadricCoefficients &Renderer::coefficients() const {
+    return m_coefficients;
 }
-Renderer::~Renderer() { m_timer.invalidate(); }
 
-void Renderer::setupConnection() {
-    QObject::connect(
-        m_ellipsoid, &Ellipsoid::renderRequested, this,
-        &Renderer::renderEllipsoid, Qt::QueuedConnection
-    );
+const AccumulationBuffer &Renderer::accumulation() const {
+    return m_accumulation;
 }
 
-void Renderer::renderEllipsoid(Params params) {
-    DPRINT("Starting rendering...");
+Renderer::Kernel Renderer::kernel() const { return m_kernel; }
+
+void Renderer::setKernel(Kernel value) {
+    // Cached frames were rendered in the old mode
+    if (value != m_kernel)
+        m_frameCache.clear();
+    m_kernel = value;
+}
+
+Renderer::Specular Renderer::specular() const { return m_specular; }
+
+void Renderer::setSpecular(Specular value) {
+    if (value != m_specular)
+        m_frameCache.clear();
+    m_specular = value;
+}
+
+float Renderer::specularTableError() const {
+    return m_specular == Specular::Table ? m_specularTableError : 0;
+}
+
+Renderer::Precision Renderer::precision() const { return m_precision; }
+
+void Renderer::setPrecision(Precision value) {
+    if (value != m_precision)
+        m_frameCache.clear();
+    m_precision = value;
+}
+
+TileOrder Renderer::tileOrder() const { return m_tileOrder; }
+
+void Renderer::setTileOrder(TileOrder value) { m_tileOrder = value; }
+
+bool Renderer::adaptiveRefinement() const { return m_adaptive; }
+
+bool Renderer::reprojection() const { return m_reprojection; }
+
+uint Renderer::tileWidth() const { return m_tileWidth; }
 
+uint Renderer::tileHeight() const { return m_tileHeight; }
+
+uint Renderer::threadCount() const { return m_scheduler.threadCount(); }
+
+void Renderer::setAdaptiveRefinement(bool value) {
+    if (value != m_adaptive)
+        m_frameCache.clear();
+    m_adaptive = value;
+}
+
+void Renderer::setReprojection(bool value) { m_reprojection = value; }
+
+void Renderer::setFrameCacheBudget(qint64 bytes) {
+    m_frameCache.setBudget(bytes);
+}
+
+void Renderer::setTileSize(uint width, uint height) {
+    m_tileWidth  = qMax(width, 1u);
+    m_tileHeight = qMax(height, 1u);
+}
+
+void Renderer::setThreadCount(uint value) {
+    m_scheduler.setThreadCount(value);
+}
+
+void Renderer::cancelBefore(quint64 generation) {
+    m_newestGeneration.storeRelease(generation);
+}
+
+void Renderer::cancelExportsBefore(quint64 id) {
+    m_newestExport.storeRelease(id);
+}
+
+void Renderer::forgetLastPass() {
+    m_lastPassValid = false;
+    m_latestBuffer  = nullptr;
+    m_samples       = 0;
+}
+
+const InstanceBvh &Renderer::instances() const { return m_instances; }
+
+void Renderer::setInstances(const QList<Instance> &instances) {
+    m_instances.build(instances, m_scheduler);
+    // Cached frames and the last pass show the scene as it was
+    m_frameCache.clear();
+    forgetLastPass();
+}
+
+void Renderer::moveInstance(uint index, const Instance &instance) {
+    m_instances.refit(index, instance);
+    m_frameCache.clear();
+    forgetLastPass();
+}
+
+RenderStats Renderer::completedStats(
+    quint64 generation, uint granularity
+) const {
+    RenderStats res{};
+    res.generation       = generation;
+    res.pixelGranularity = granularity;
+    res.durationNs       = m_timer.nsecsElapsed();
+    res.samples          = 1;
+    res.chainRaysTraced  = m_chainRaysTraced;
+    res.latencyNs        = -1;
+    return res;
+}
+
+bool Renderer::isStale(quint64 generation) const {
+    return generation < m_newestGeneration.loadAcquire();
+}
+
+bool Renderer::isExportStale(quint64 id) const {
+    return id < m_newestExport.loadAcquire();
+}
+
+PMat4 Renderer::setUpScene(const Params &params) {
     m_equation = PMat4::diagonal(
         1.f / (params.stretchX * params.stretchX),
         1.f / (params.stretchY * params.stretchY),
@@ -105,8 +252,9 @@ void Renderer::renderEllipsoid(Params params) {
         * PMat4::scaling(params.scale, params.scale, params.scale);
     auto view = PMat4::lookAt(m_camera, {}, {0, 1, 0});
     // auto projection = PMat4::orthographic(20.f, 20.f, 0.1f, 19.9f);
-    auto projection =
-        PMat4::perspective(params.height / params.width, PI_F / 2, 0.1f, 19.9f);
+    auto projection = PMat4::perspective(
+        (float)params.height / params.width, PI_F / 2, 0.1f, 19.9f
+    );
 
     auto pv     = projection * view;
     m_pvInverse = pv.inverse();
@@ -114,73 +262,1070 @@ void Renderer::renderEllipsoid(Params params) {
     auto pvmInverse = (pv * model).inverse();
     m_pvme          = pvmInverse.transpose() * m_equation * pvmInverse;
 
-    const auto pixels = m_ellipsoid->m_pixelData.data();
+    const auto &q = m_pvme;
+    m_coefficients = {
+        q[{2, 2}],
+        q[{0, 2}] + q[{2, 0}],
+        q[{1, 2}] + q[{2, 1}],
+        q[{3, 2}] + q[{2, 3}],
+        q[{0, 0}],
+        q[{1, 1}],
+        q[{0, 1}] + q[{1, 0}],
+        q[{0, 3}] + q[{3, 0}],
+        q[{1, 3}] + q[{3, 1}],
+        q[{3, 3}],
+    };
+    if (!m_instances.isEmpty())
+        m_instanceRect = instanceRect(pv, params.width, params.height);
+    return pv;
+}
 
-    // TODO: Add cancellation
-    QtConcurrent::blockingMap(
-        ScreenIterator2D::begin(
-            params.width, params.height, params.pixelGranularity
-        ),
-        ScreenIterator2D::end(
-            params.width, params.height, params.pixelGranularity
-        ),
-        [this, pixels, &params](Position2D pos) {
-            const auto &[x, y] = pos;
+void Renderer::renderEllipsoid(Params params, quint64 generation) {
+    if (isStale(generation)) {
+        DPRINT("Skipping stale render.");
+        emit renderCancelled(generation);
+        return;
+    }
 
-            const auto
-                &[w, h, sub, r, g, b, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10,
-                  a, d, s, sf] = params;
+    DPRINT("Starting rendering...");
+    m_timer.start();
+    // Supersampling sums no longer match whatever this pass leaves behind
+    m_samples = 0;
 
-            const auto intensity = lightIntensityAtCastRay(
-                (x * 2.f + 1) / w - 1, (y * 2.f + 1) / h - 1, a, d, s, sf
+    // Resizing clears both buffers, so there is nothing left to build on
+    const auto resizeCount = m_frames.resizeCount();
+    if (resizeCount != m_framesResizeCount) {
+        m_framesResizeCount = resizeCount;
+        m_lastPassValid     = false;
+        m_latestBuffer      = nullptr;
+        m_lastFrameSize     = {};
+    }
+
+    const auto  pv = setUpScene(params);
+    const auto &q  = m_pvme;
+
+    // Passes refining the same scene would only add misses, so every scene is
+    // looked up once
+    auto lookup             = params;
+    lookup.pixelGranularity = 1;
+    if (m_frameCache.budget() > 0 && lookup != m_lastLookup) {
+        m_lastLookup = lookup;
+        QRect      hitBounds;
+        const auto cached = m_frameCache.find(params, hitBounds);
+        if (cached != nullptr) {
+            presentCached(params, pv, *cached, hitBounds, generation);
+            return;
+        }
+    }
+
+    // NaN at first, which never compares equal
+    if (m_specular == Specular::Table
+        && params.lightSpecularFocus != m_specularTableFocus)
+        buildSpecularTable(params.lightSpecularFocus);
+
+    // The surface buffer still holds the geometry of the last completed pass.
+    // If only shading changed, or nothing finer was asked for, shading that
+    // again beats tracing a coarser frame.
+    m_surfaces.resize(params.width, params.height);
+    const auto shadeOnly =
+        m_lastPassValid && m_lastPass.sameGeometry(params)
+        && (!m_lastPass.sameShading(params)
+            || params.pixelGranularity >= m_lastPass.pixelGranularity);
+    if (shadeOnly)
+        params.pixelGranularity = m_lastPass.pixelGranularity;
+
+    // A camera move alone leaves every surface point where it was, so the
+    // latest frame can be warped into the new view. The chain must still end
+    // with a traced pass, and one at full resolution fits the budget anyway.
+    // Warping takes depth from the single quadric, instances have none.
+    const auto reproject =
+        m_reprojection && m_instances.isEmpty() && !shadeOnly
+        && params.pixelGranularity > 1 && m_latestBuffer != nullptr
+        && m_latestFrame.sameModel(params) && m_latestFrame.sameShading(params)
+        && !m_latestFrame.sameGeometry(params);
+    if (reproject) {
+        m_toLatest = m_latestPv * m_pvInverse;
+
+        // The latest camera in homogeneous new NDC, not divided by its w,
+        // which is close to 0 after small moves. Its product with the quadric
+        // gives the polar plane of that camera, the surface points facing it
+        // lie in front of that plane.
+        PVec4 camera;
+        for (uint i = 0; i < 4; i++)
+            for (uint j = 0; j < 4; j++)
+                camera[i] += pv[{i, j}] * m_latestCamera[j];
+        m_latestCameraPlane = {};
+        for (uint i = 0; i < 4; i++)
+            for (uint j = 0; j < 4; j++)
+                m_latestCameraPlane[i] +=
+                    (q[{i, j}] + q[{j, i}]) / 2 * camera[j];
+    }
+
+    // Reprojection copies or traces every pixel, later passes of its chain
+    // only touch their samples
+    const auto sparse = !reproject && m_latestReprojected
+                     && m_latestBuffer != nullptr
+                     && m_latestFrame.sameGeometry(params);
+    const auto sub        = reproject ? 1 : params.pixelGranularity;
+    auto       tileParams = params;
+    tileParams.pixelGranularity = sub;
+
+    // Every sample of a coarser lattice is also a sample of this one, so
+    // these need not be traced again
+    auto previous             = m_lastPass;
+    previous.pixelGranularity = params.pixelGranularity;
+    const auto reusable       = m_lastPassValid && previous == params
+                         && m_lastPass.pixelGranularity > sub
+                         && m_lastPass.pixelGranularity % sub == 0;
+    const auto reusedGranularity = reusable ? m_lastPass.pixelGranularity : 0;
+    if (!reusable && !shadeOnly && !sparse)
+        m_chainRaysTraced = 0;
+
+    const auto tiles = passTiles(params.width, params.height, sub);
+
+    // Reused samples must be copied over if the back buffer was presented,
+    // and so must the warped pixels between sparse samples
+    auto &pixels = m_frames.beginPass(reusable || sparse);
+    if (!fitsFrame(pixels, params, generation))
+        return;
+    m_lastPassValid = false;
+
+    PassMode mode{reusedGranularity, shadeOnly, sparse, nullptr};
+    if (reproject && m_latestBuffer == &pixels) {
+        // Not presented yet, and about to be overwritten
+        m_reprojectionSource.resize(params.width, params.height);
+        m_reprojectionSource.copyFrom(pixels);
+        mode.reprojectFrom = &m_reprojectionSource;
+    } else if (reproject) {
+        mode.reprojectFrom = m_latestBuffer;
+    }
+
+    QMutex    statsMutex;
+    TileStats passStats;
+    // Finished tiles not reported yet, and when they may be next
+    QRegion finished;
+    qint64  nextProgressNs = m_timer.nsecsElapsed() + STREAM_INTERVAL_NS;
+    m_scheduler.run(
+        tiles,
+        [this, &tileParams, &mode, &pixels, &statsMutex, &passStats,
+         &finished, &nextProgressNs, generation](const Tile &tile) {
+            if (isStale(generation))
+                return;
+            TileStats stats;
+            renderTile(tile, tileParams, mode, pixels, stats);
+
+            QMutexLocker lock{&statsMutex};
+            passStats.raysTraced       += stats.raysTraced;
+            passStats.raysHit          += stats.raysHit;
+            passStats.raysCulled       += stats.raysCulled;
+            passStats.raysInterpolated += stats.raysInterpolated;
+            passStats.raysReprojected  += stats.raysReprojected;
+            passStats.pixelsWritten    += stats.pixelsWritten;
+            passStats.writeNs          += stats.writeNs;
+            passStats.hitBounds        |= stats.hitBounds;
+
+            finished += QRect(tile.x, tile.y, tile.width, tile.height);
+            const auto elapsedNs = m_timer.nsecsElapsed();
+            if (elapsedNs < nextProgressNs)
+                return;
+            nextProgressNs   = elapsedNs + STREAM_INTERVAL_NS;
+            const auto ready = std::exchange(finished, {});
+            lock.unlock();
+            emit renderProgressed(generation, ready);
+        }
+    );
+
+    if (isStale(generation)) {
+        m_frames.endPass(false);
+        // The latest frame is gone if this pass was written over it
+        if (m_latestBuffer == &pixels)
+            m_latestBuffer = nullptr;
+        DPRINT("Rendering cancelled.");
+        emit renderCancelled(generation);
+        return;
+    }
+    m_frames.endPass(true);
+
+    // Reprojected pixels are no samples of any lattice, the next pass starts
+    // over on its own
+    m_lastPass         = params;
+    m_lastPassValid    = !reproject;
+    m_chainRaysTraced += passStats.raysTraced;
+
+    // Sparse passes leave warped pixels behind until every pixel is a sample
+    m_latestFrame       = params;
+    m_latestBuffer      = &pixels;
+    m_latestPv          = pv;
+    m_latestCamera      = m_camera;
+    m_latestReprojected = reproject || (sparse && sub > 1);
+
+    // The background never changes, so pixels can only differ where either
+    // this pass or the previous one hit. Reused samples were hits of the
+    // previous pass, they only need to stay in the bounds for the next one,
+    // and so do the pixels sparse passes leave alone.
+    const QSize frameSize(params.width, params.height);
+    QRect       dirtyRect;
+    if (frameSize != m_lastFrameSize) {
+        dirtyRect       = QRect(0, 0, params.width, params.height);
+        m_lastFrameSize = frameSize;
+    } else {
+        dirtyRect = passStats.hitBounds | m_lastHitBounds;
+    }
+    m_lastHitBounds = reusable || sparse
+                        ? passStats.hitBounds | m_lastHitBounds
+                        : passStats.hitBounds;
+
+    // Warped pixels would stay around for as long as the frame is cached
+    if (sub == 1 && !m_latestReprojected && m_frameCache.budget() > 0)
+        m_frameCache.insert(params, pixels, m_lastHitBounds);
+
+    auto stats = completedStats(generation, params.pixelGranularity);
+    stats.shadeOnly        = shadeOnly;
+    stats.raysTraced       = passStats.raysTraced;
+    stats.raysHit          = passStats.raysHit;
+    stats.raysCulled       = passStats.raysCulled;
+    stats.raysInterpolated = passStats.raysInterpolated;
+    stats.raysReprojected  = passStats.raysReprojected;
+    stats.pixelsWritten    = passStats.pixelsWritten;
+    stats.dirtyRect        = dirtyRect;
+    stats.threadBusyNs     = m_scheduler.busyNs();
+    stats.pixelWriteNs     = passStats.writeNs;
+
+    DPRINT("Rendering completed.");
+    emit renderCompleted(stats);
+}
+
+void Renderer::supersample(Params params, quint64 generation) {
+    if (isStale(generation)) {
+        DPRINT("Skipping stale supersampling.");
+        emit renderCancelled(generation);
+        return;
+    }
+
+    DPRINT("Starting supersampling...");
+    m_timer.start();
+
+    // Edges are found in the surface buffer, which must hold this very frame
+    params.pixelGranularity = 1;
+    const auto refinable    = m_lastPassValid && m_lastPass == params
+                         && m_frames.resizeCount() == m_framesResizeCount;
+    if (!refinable || (m_samples > 0 && m_edgeTiles.isEmpty())) {
+        auto stats    = completedStats(generation, 1);
+        stats.samples = 0;
+        DPRINT("Nothing to supersample.");
+        emit renderCompleted(stats);
+        return;
+    }
+
+    // The first pass looks for edges wherever the last one may have hit,
+    // which includes the misses right next to it
+    const auto  first = m_samples == 0;
+    QList<Tile> tiles;
+    if (first) {
+        m_accumulation.resize(params.width, params.height);
+        m_edgeTiles.clear();
+        m_edgeBounds     = {};
+        const auto reach = m_lastHitBounds.adjusted(-1, -1, 1, 1);
+        for (const auto &tile : passTiles(params.width, params.height, 1)) {
+            const QRect rect(tile.x, tile.y, tile.width, tile.height);
+            if (reach.intersects(rect))
+                tiles.append(tile);
+        }
+    } else {
+        tiles = m_edgeTiles;
+    }
+    const auto index = qMax(m_samples, 1u);
+
+    auto &pixels = m_frames.beginPass(true);
+    if (!fitsFrame(pixels, params, generation))
+        return;
+
+    QMutex    statsMutex;
+    TileStats passStats;
+    m_scheduler.run(
+        tiles,
+        [this, &params, &pixels, &statsMutex, &passStats, first, index,
+         generation](const Tile &tile) {
+            if (isStale(generation))
+                return;
+            if (first) {
+                const auto bounds = markEdges(tile, params);
+                if (bounds.isEmpty())
+                    return;
+                QMutexLocker lock{&statsMutex};
+                m_edgeTiles.append(tile);
+                m_edgeBounds |= bounds;
+            }
+            TileStats stats;
+            supersampleTile(tile, params, index, pixels, stats);
+
+            QMutexLocker lock{&statsMutex};
+            passStats.raysTraced    += stats.raysTraced;
+            passStats.raysHit       += stats.raysHit;
+            passStats.pixelsWritten += stats.pixelsWritten;
+            passStats.writeNs       += stats.writeNs;
+        }
+    );
+
+    // Some sums may have taken this sample and others not
+    if (isStale(generation)) {
+        m_frames.endPass(false);
+        m_samples = 0;
+        if (m_latestBuffer == &pixels)
+            m_latestBuffer = nullptr;
+        DPRINT("Supersampling cancelled.");
+        emit renderCancelled(generation);
+        return;
+    }
+    m_frames.endPass(true);
+
+    // Only edge pixels changed, misses among them may no longer be background
+    m_samples          = index + 1;
+    m_chainRaysTraced += passStats.raysTraced;
+    m_latestFrame      = params;
+    m_latestBuffer     = &pixels;
+    m_lastHitBounds   |= m_edgeBounds;
+
+    auto stats          = completedStats(generation, 1);
+    stats.samples       = m_edgeTiles.isEmpty() ? 0 : m_samples;
+    stats.raysTraced    = passStats.raysTraced;
+    stats.raysHit       = passStats.raysHit;
+    stats.pixelsWritten = passStats.pixelsWritten;
+    stats.dirtyRect     = m_edgeBounds;
+    stats.threadBusyNs  = m_scheduler.busyNs();
+    stats.pixelWriteNs  = passStats.writeNs;
+
+    DPRINT("Supersampling completed.");
+    emit renderCompleted(stats);
+}
+
+void Renderer::exportImage(Params params, QString path, quint64 id) {
+    if (isExportStale(id)) {
+        DPRINT("Skipping stale export.");
+        emit exportCancelled(id);
+        return;
+    }
+
+    StreamingImageWriter::Format format;
+    if (!StreamingImageWriter::formatForPath(path, format)) {
+        emit exportFailed(id, QString("Unknown image format: %1").arg(path));
+        return;
+    }
+    StreamingImageWriter writer;
+    if (!writer.open(path, format, params.width, params.height)) {
+        emit exportFailed(id, writer.errorString());
+        return;
+    }
+
+    DPRINT("Starting export...");
+    // The scene is about to be set up for another size, which nothing kept
+    // from the last pass would match
+    forgetLastPass();
+    setUpScene(params);
+    if (m_specular == Specular::Table
+        && params.lightSpecularFocus != m_specularTableFocus)
+        buildSpecularTable(params.lightSpecularFocus);
+
+    // The encoder takes the top row first, the pixel buffer stores rows
+    // bottom-up
+    const auto  width    = params.width;
+    const auto  height   = params.height;
+    const auto  bandRows = m_tileHeight * EXPORT_BAND_TILE_ROWS;
+    PixelBuffer band;
+    for (uint top = 0; top < height; top += bandRows) {
+        const auto rows  = qMin(bandRows, height - top);
+        const auto bandY = height - top - rows;
+        band.resize(width, rows);
+        m_scheduler.run(
+            passTiles(width, rows, 1),
+            [this, &params, &band, bandY, id](const Tile &tile) {
+                if (isExportStale(id))
+                    return;
+                exportTile(tile, params, bandY, band);
+            }
+        );
+
+        if (isExportStale(id)) {
+            writer.cancel();
+            DPRINT("Export cancelled.");
+            emit exportCancelled(id);
+            return;
+        }
+        for (uint y = rows; y-- > 0;) {
+            if (!writer.writeRow(band.constRow(y))) {
+                emit exportFailed(id, writer.errorString());
+                return;
+            }
+        }
+        emit exportProgressed(id, top + rows);
+    }
+
+    if (!writer.commit()) {
+        emit exportFailed(id, writer.errorString());
+        return;
+    }
+    DPRINT("Export completed.");
+    emit exportCompleted(id, path);
+}
+
+bool Renderer::fitsFrame(
+    const PixelBuffer &pixels, const Params &params, quint64 generation
+) {
+    if (pixels.width() == params.width && pixels.height() == params.height)
+        return true;
+
+    m_frames.endPass(false);
+    DPRINT("Frame size changed, rendering cancelled.");
+    emit renderCancelled(generation);
+    return false;
+}
+
+QList<Tile> Renderer::passTiles(uint width, uint height, uint sub) const {
+    const auto alignX     = std::lcm(sub, CACHE_LINE_PIXELS);
+    const auto tileWidth  = (m_tileWidth + alignX - 1) / alignX * alignX;
+    const auto tileHeight = (m_tileHeight + sub - 1) / sub * sub;
+    const auto columns    = (width + tileWidth - 1) / tileWidth;
+    const auto rows       = (height + tileHeight - 1) / tileHeight;
+
+    QList<std::pair<quint64, Tile>> ordered;
+    ordered.reserve(columns * rows);
+    for (uint row = 0; row < rows; row++) {
+        for (uint column = 0; column < columns; column++) {
+            const auto x = column * tileWidth;
+            const auto y = row * tileHeight;
+            const Tile tile{
+                x, y, qMin(tileWidth, width - x), qMin(tileHeight, height - y)
+            };
+            ordered.append(
+                {tileOrderKey(m_tileOrder, column, row, columns, rows), tile}
             );
+        }
+    }
+    std::sort(
+        ordered.begin(), ordered.end(),
+        [](const auto &a, const auto &b) { return a.first < b.first; }
+    );
 
-            const auto xEnd = qMin(x + sub, w);
-            const auto yEnd = qMin(y + sub, h);
-            for (uint i = y; i < yEnd; i++) {
-                for (uint j = x; j < xEnd; j++) {
-                    pixels[(i * w + j) * 4 + 0] = r * intensity;
-                    pixels[(i * w + j) * 4 + 1] = g * intensity;
-                    pixels[(i * w + j) * 4 + 2] = b * intensity;
-                    pixels[(i * w + j) * 4 + 3] = 255;
-                }
+    QList<Tile> res;
+    res.reserve(ordered.size());
+    for (const auto &[key, tile] : ordered)
+        res.append(tile);
+    return res;
+}
+
+void Renderer::traceTiles(
+    const QList<Tile> &tiles, const Params &params,
+    const std::function<void()>                   &tileStarted,
+    const std::function<void(quint64 raysTraced)> &tileTraced
+) {
+    const PassMode mode{};
+
+    auto &pixels = m_frames.beginPass(false);
+    m_scheduler.run(tiles, [&](const Tile &tile) {
+        tileStarted();
+        TileStats stats;
+        renderTile(tile, params, mode, pixels, stats);
+        tileTraced(stats.raysTraced);
+    });
+    m_frames.endPass(false);
+}
+
+void Renderer::presentCached(
+    const Params &params, const PMat4 &pv, const PixelBuffer &frame,
+    const QRect &hitBounds, quint64 generation
+) {
+    auto &pixels = m_frames.beginPass(false);
+    if (!fitsFrame(pixels, params, generation))
+        return;
+    pixels.copyFrom(frame);
+    m_frames.endPass(true);
+
+    // The surface buffer does not hold this frame, so nothing can be reused
+    // but its pixels
+    m_lastPassValid     = false;
+    m_chainRaysTraced   = 0;
+    m_latestFrame       = params;
+    m_latestBuffer      = &pixels;
+    m_latestPv          = pv;
+    m_latestCamera      = m_camera;
+    m_latestReprojected = false;
+
+    const QSize frameSize(params.width, params.height);
+    QRect       dirtyRect;
+    if (frameSize != m_lastFrameSize) {
+        dirtyRect       = QRect(0, 0, params.width, params.height);
+        m_lastFrameSize = frameSize;
+    } else {
+        dirtyRect = hitBounds | m_lastHitBounds;
+    }
+    m_lastHitBounds = hitBounds;
+
+    // Delivered at full resolution, which ends the chain
+    auto stats          = completedStats(generation, 1);
+    stats.cached        = true;
+    stats.pixelsWritten = (quint64)params.width * params.height;
+    stats.dirtyRect     = dirtyRect;
+
+    DPRINT("Presented cached frame.");
+    emit renderCompleted(stats);
+}
+
+QRect Renderer::markEdges(const Tile &tile, const Params &params) {
+    const auto
+        &[w, h, _s, _r, _g, _b, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, a, d,
+          s, sf] = params;
+
+    // Pixels on either side of the silhouette, where it may cross them
+    QRect      bounds;
+    const auto xEnd = tile.x + tile.width;
+    const auto yEnd = tile.y + tile.height;
+    for (uint y = tile.y; y < yEnd; y++) {
+        const auto above = m_surfaces.constRow(qMin(y + 1, h - 1));
+        const auto here  = m_surfaces.constRow(y);
+        const auto below = m_surfaces.constRow(y > 0 ? y - 1 : 0);
+        auto       sums  = m_accumulation.row(y);
+        uint       left  = xEnd;
+        uint       right = tile.x;
+        for (uint x = tile.x; x < xEnd; x++) {
+            const auto hit   = here[x].hit;
+            const auto begin = x > 0 ? x - 1 : 0;
+            const auto end   = qMin(x + 1, w - 1);
+            auto       edge  = false;
+            for (uint i = begin; i <= end; i++)
+                edge = edge || above[i].hit != hit || here[i].hit != hit
+                    || below[i].hit != hit;
+            if (!edge) {
+                sums[x] = -1;
+                continue;
             }
+            sums[x] = lightIntensity(here[x], a, d, s, sf);
+            left    = qMin(left, x);
+            right   = x + 1;
+        }
+        if (left < right)
+            bounds |= QRect(left, y, right - left, 1);
+    }
+    return bounds;
+}
+
+void Renderer::supersampleTile(
+    const Tile &tile, const Params &params, uint index, PixelBuffer &pixels,
+    TileStats &stats
+) {
+    const auto
+        &[w, h, _s, r, g, b, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, a, d,
+          s, sf] = params;
+
+    // Offset from the pixel centre, the first point of the sequence is the
+    // centre itself, which the last pass already took
+    const auto jitterX = std::fmod(0.5 + index * R2_STEP_X, 1.) - 0.5;
+    const auto jitterY = std::fmod(0.5 + index * R2_STEP_Y, 1.) - 0.5;
+    const auto samples = index + 1.f;
+
+    const auto xEnd = tile.x + tile.width;
+    const auto yEnd = tile.y + tile.height;
+    QVarLengthArray<Pixel, ROW_SAMPLES> colours(tile.width);
+    QElapsedTimer                       timer;
+    for (uint y = tile.y; y < yEnd; y++) {
+        const auto ndcY = (float)(((y + 0.5 + jitterY) * 2) / h - 1);
+        auto       sums = m_accumulation.row(y);
+        for (uint x = tile.x; x < xEnd; x++) {
+            auto &colour = colours[x - tile.x];
+            colour       = KEEP_PIXEL;
+            if (sums[x] < 0)
+                continue;
+            const auto ndcX    = (float)(((x + 0.5 + jitterX) * 2) / w - 1);
+            const auto sample  = castRay(ndcX, ndcY);
+            sums[x]           += lightIntensity(sample, a, d, s, sf);
+            colour             = shadePixel(r, g, b, sums[x] / samples);
+            stats.raysTraced++;
+            stats.raysHit += sample.hit;
         }
+
+        timer.start();
+        stats.pixelsWritten += writeSamples(
+            pixels, y, y + 1, tile.x, xEnd, 1, 1, colours.data(), tile.width
+        );
+        stats.writeNs += timer.nsecsElapsed();
+    }
+}
+
+void Renderer::renderTile(
+    const Tile &tile, const Params &params, const PassMode &mode,
+    PixelBuffer &pixels, TileStats &stats
+) {
+    const auto yEnd = tile.y + tile.height;
+    for (uint y = tile.y; y < yEnd; y += params.pixelGranularity)
+        renderRow(y, tile.x, tile.x + tile.width, params, mode, pixels, stats);
+}
+
+void Renderer::renderRow(
+    uint y, uint xBegin, uint xEnd, const Params &params,
+    const PassMode &mode, PixelBuffer &pixels, TileStats &stats
+) {
+    const auto
+        &[w, h, sub, r, g, b, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, a, d,
+          s, sf] = params;
+
+    const auto reusedGranularity = mode.reusedGranularity;
+    const auto shadeOnly         = mode.shadeOnly;
+    const auto sparse            = mode.sparse;
+
+    const auto ndcY = (y * 2.f + 1) / h - 1;
+    const auto yEnd = qMin(y + sub, h);
+    // Sparse passes write single pixels instead of blocks
+    const auto blockSize = sparse ? 1 : sub;
+    const auto blockEnd  = sparse ? y + 1 : yEnd;
+
+    const ScanlineCoefficients scanline{m_coefficients, ndcY};
+
+    const auto rowReused =
+        reusedGranularity != 0 && y % reusedGranularity == 0;
+
+    // Only samples inside the silhouette span get traced, or inside the
+    // projected box around the instances
+    uint       traceBegin = xEnd;
+    uint       traceEnd   = xEnd;
+    double     left, right;
+    const auto spanned = m_instances.isEmpty()
+                           ? silhouetteSpan(scanline, w, left, right)
+                           : instanceSpan(y, left, right);
+    if (spanned) {
+        const auto first = std::ceil(left / sub);
+        const auto last  = std::floor(right / sub);
+        traceBegin = std::clamp<double>(first * sub, xBegin, xEnd);
+        traceEnd   = std::clamp<double>((last + 1) * sub, traceBegin, xEnd);
+    }
+
+    // Colours are staged by sample and written once the row is shaded, so
+    // that blocks fill whole runs of pixels at a time. Culled samples are
+    // background, reused ones included. Reprojection already decided that
+    // for every pixel a sparse pass leaves alone.
+    const auto sampleIndex = [&](uint x) {
+        return (x - xBegin + sub - 1) / sub;
+    };
+    const auto sampleCount = sampleIndex(xEnd);
+    const auto culled      = sparse ? KEEP_PIXEL : BACKGROUND_PIXEL;
+    QVarLengthArray<Pixel, ROW_SAMPLES> colours(sampleCount);
+    fillPixels(colours.data(), sampleIndex(traceBegin), culled);
+    fillPixels(
+        colours.data() + sampleIndex(traceBegin),
+        sampleIndex(traceEnd) - sampleIndex(traceBegin), KEEP_PIXEL
+    );
+    fillPixels(
+        colours.data() + sampleIndex(traceEnd),
+        sampleCount - sampleIndex(traceEnd), culled
     );
 
-    const auto sinceLastFrameMs = m_timer.elapsed();
-    if (sinceLastFrameMs < FRAME_INTERVAL_MS)
-        QThread::msleep(FRAME_INTERVAL_MS - sinceLastFrameMs);
-    m_timer.start();
+    auto surfaces = m_surfaces.row(y);
 
-    DPRINT("Rendering completed.");
-    emit renderCompleted();
+    // Shades samples sorted by x and stages their colours
+    const auto shadeSamples =
+        [&](const uint *xs, const SurfaceSample *samples, uint count) {
+        float intensities[PPacket::WIDTH];
+        for (uint l = 0; l < count; l++) {
+            intensities[l] = lightIntensity(samples[l], a, d, s, sf);
+            colours[sampleIndex(xs[l])] = shadePixel(r, g, b, intensities[l]);
+        }
+
+        // Zero intensity gives the background colour
+        uint firstHit = 0;
+        while (firstHit < count && intensities[firstHit] <= 0.f)
+            firstHit++;
+        if (firstHit < count) {
+            uint lastHit = count - 1;
+            while (intensities[lastHit] <= 0.f)
+                lastHit--;
+            const auto right = qMin(xs[lastHit] + blockSize, xEnd);
+            stats.hitBounds |= QRect(
+                xs[firstHit], y, right - xs[firstHit], blockEnd - y
+            );
+        }
+    };
+
+    // Adaptive refinement looks at the corners of the reused block around a
+    // sample, which are samples of the previous pass
+    const auto adaptive = m_adaptive && reusedGranularity != 0;
+    const auto blockY =
+        adaptive ? y / reusedGranularity * reusedGranularity : 0;
+    const auto blockFlat = [&](uint blockX, SurfaceSample *corners) {
+        const auto size = reusedGranularity;
+        if (blockX + size >= w || blockY + size >= h)
+            return false;
+
+        const auto top    = m_surfaces.constRow(blockY);
+        const auto bottom = m_surfaces.constRow(blockY + size);
+        corners[0]        = top[blockX];
+        corners[1]        = top[blockX + size];
+        corners[2]        = bottom[blockX];
+        corners[3]        = bottom[blockX + size];
+
+        auto minIntensity = 1.f;
+        auto maxIntensity = 0.f;
+        for (uint i = 0; i < 4; i++) {
+            if (corners[i].hit != corners[0].hit)
+                return false;
+            const auto intensity = lightIntensity(corners[i], a, d, s, sf);
+            minIntensity         = qMin(minIntensity, intensity);
+            maxIntensity         = qMax(maxIntensity, intensity);
+        }
+        return maxIntensity - minIntensity <= ADAPTIVE_THRESHOLD;
+    };
+    uint          cornersX = UINT_MAX;
+    bool          flat     = false;
+    SurfaceSample corners[4];
+
+    uint              lanes = 0;
+    uint              xs[PPacket::WIDTH];
+    alignas(32) float ndcXs[PPacket::WIDTH];
+    alignas(32) float bs[PPacket::WIDTH];
+    alignas(32) float cs[PPacket::WIDTH];
+    SurfaceSample     samples[PPacket::WIDTH];
+
+    // Pixels the latest frame shows are copied from it, misses filled with
+    // the background, and the rest moved to the front lanes to be traced
+    const auto reprojectLanes = [&]() {
+        bool   hits[PPacket::WIDTH];
+        qint32 sourceXs[PPacket::WIDTH];
+        qint32 sourceYs[PPacket::WIDTH];
+        reprojectRays(
+            PPacket::load(ndcXs), ndcY, PPacket::load(bs), PPacket::load(cs),
+            w, h, hits, sourceXs, sourceYs
+        );
+
+        auto source    = mode.reprojectFrom;
+        uint traced    = 0;
+        uint copied    = 0;
+        uint copyBegin = xEnd;
+        uint copyEnd   = xBegin;
+        for (uint l = 0; l < lanes; l++) {
+            if (!hits[l]) {
+                colours[sampleIndex(xs[l])] = BACKGROUND_PIXEL;
+                stats.raysCulled++;
+                continue;
+            }
+            if (sourceXs[l] < 0) {
+                xs[traced]    = xs[l];
+                ndcXs[traced] = ndcXs[l];
+                bs[traced]    = bs[l];
+                cs[traced]    = cs[l];
+                traced++;
+                continue;
+            }
+            colours[sampleIndex(xs[l])] =
+                source->constRow(sourceYs[l])[sourceXs[l]];
+            copyBegin = qMin(copyBegin, xs[l]);
+            copyEnd   = xs[l] + 1;
+            copied++;
+        }
+        if (copyBegin < copyEnd)
+            stats.hitBounds |= QRect(copyBegin, y, copyEnd - copyBegin, 1);
+        stats.raysReprojected += copied;
+
+        lanes = traced;
+        for (uint l = lanes; l < PPacket::WIDTH; l++) {
+            ndcXs[l] = ndcXs[0];
+            bs[l]    = bs[0];
+            cs[l]    = cs[0];
+        }
+    };
+
+    const auto flush = [&]() {
+        if (mode.reprojectFrom != nullptr) {
+            reprojectLanes();
+            if (lanes == 0)
+                return;
+        }
+        if (shadeOnly) {
+            for (uint l = 0; l < lanes; l++)
+                samples[l] = surfaces[xs[l]];
+        } else {
+            // Instances are traced one ray at a time, whatever the kernel
+            const auto kernel =
+                m_instances.isEmpty() ? m_kernel : Kernel::Scalar;
+            switch (kernel) {
+            case Kernel::Scalar:
+                for (uint l = 0; l < lanes; l++)
+                    samples[l] = castRay(ndcXs[l], ndcY, bs[l], cs[l]);
+                break;
+            case Kernel::Packet:
+                castRays(
+                    PPacket::load(ndcXs), ndcY, PPacket::load(bs),
+                    PPacket::load(cs), samples
+                );
+                break;
+            }
+            for (uint l = 0; l < lanes; l++) {
+                surfaces[xs[l]] = samples[l];
+                stats.raysHit  += samples[l].hit;
+            }
+            stats.raysTraced += lanes;
+        }
+        shadeSamples(xs, samples, lanes);
+        lanes = 0;
+    };
+
+    // Nothing reuses the surfaces of a reprojected pass, so its culled pixels
+    // need no visit. Tiles start on the sample lattice, so the walk stays on
+    // it.
+    auto walkBegin = xBegin;
+    auto walkEnd   = xEnd;
+    if (mode.reprojectFrom != nullptr) {
+        stats.raysCulled += (xEnd - xBegin) - (traceEnd - traceBegin);
+        walkBegin         = traceBegin;
+        walkEnd           = traceEnd;
+    }
+    ScanlineWalker walker{
+        scanline, (walkBegin * 2. + 1) / w - 1, 2. * sub / w
+    };
+    for (uint x = walkBegin; x < walkEnd; x += sub, walker.advance()) {
+        if (rowReused && x % reusedGranularity == 0)
+            continue;
+        if (x < traceBegin || x >= traceEnd) {
+            surfaces[x].hit = false;
+            stats.raysCulled++;
+            continue;
+        }
+        if (adaptive) {
+            const auto blockX = x / reusedGranularity * reusedGranularity;
+            if (blockX != cornersX) {
+                cornersX = blockX;
+                flat     = blockFlat(blockX, corners);
+            }
+            if (flat) {
+                const auto sample = interpolate(
+                    corners, (float)(x - blockX) / reusedGranularity,
+                    (float)(y - blockY) / reusedGranularity
+                );
+                surfaces[x] = sample;
+                shadeSamples(&x, &sample, 1);
+                stats.raysInterpolated++;
+                continue;
+            }
+        }
+        xs[lanes]    = x;
+        ndcXs[lanes] = (x * 2.f + 1) / w - 1;
+        bs[lanes]    = walker.b;
+        cs[lanes]    = walker.c;
+        if (++lanes == PPacket::WIDTH)
+            flush();
+    }
+    if (lanes > 0) {
+        // Unused lanes must still hold valid coordinates
+        for (uint l = lanes; l < PPacket::WIDTH; l++) {
+            ndcXs[l] = ndcXs[0];
+            bs[l]    = bs[0];
+            cs[l]    = cs[0];
+        }
+        flush();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    stats.pixelsWritten += writeSamples(
+        pixels, y, blockEnd, xBegin, xEnd, sub, blockSize, colours.data(),
+        sampleCount
+    );
+    stats.writeNs += timer.nsecsElapsed();
 }
 
-float Renderer::lightIntensityAtCastRay(
-    float x, float y, float ambient, float diffuse, float specular,
-    float specularFocus
-) // both in range <-1,+1>
-{
+void Renderer::exportTile(
+    const Tile &tile, const Params &params, uint bandY, PixelBuffer &band
+) {
+    const auto
+        &[w, h, _s, r, g, b, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, a, d,
+          s, sf] = params;
+
+    // Instances are traced one ray at a time, whatever the kernel
+    const auto kernel = m_instances.isEmpty() ? m_kernel : Kernel::Scalar;
+    const auto xEnd   = tile.x + tile.width;
+    const auto yEnd   = tile.y + tile.height;
+
+    alignas(32) float ndcXs[PPacket::WIDTH];
+    alignas(32) float bs[PPacket::WIDTH];
+    alignas(32) float cs[PPacket::WIDTH];
+    SurfaceSample     samples[PPacket::WIDTH];
+
+    for (uint i = tile.y; i < yEnd; i++) {
+        const auto                 y    = bandY + i;
+        const auto                 ndcY = (y * 2.f + 1) / h - 1;
+        const ScanlineCoefficients scanline{m_coefficients, ndcY};
+
+        uint       traceBegin = xEnd;
+        uint       traceEnd   = xEnd;
+        double     left, right;
+        const auto spanned = m_instances.isEmpty()
+                               ? silhouetteSpan(scanline, w, left, right)
+                               : instanceSpan(y, left, right);
+        if (spanned) {
+            traceBegin = std::clamp<double>(std::ceil(left), tile.x, xEnd);
+            traceEnd   = std::clamp<double>(
+                std::floor(right) + 1, traceBegin, xEnd
+            );
+        }
+
+        auto row = band.row(i);
+        fillPixels(row + tile.x, traceBegin - tile.x, BACKGROUND_PIXEL);
+        fillPixels(row + traceEnd, xEnd - traceEnd, BACKGROUND_PIXEL);
+
+        ScanlineWalker walker{scanline, (traceBegin * 2. + 1) / w - 1, 2. / w};
+        for (uint x = traceBegin; x < traceEnd; x += PPacket::WIDTH) {
+            // Unused lanes must still hold valid coordinates
+            const auto lanes = qMin(traceEnd - x, PPacket::WIDTH);
+            for (uint l = 0; l < PPacket::WIDTH; l++) {
+                if (l < lanes) {
+                    ndcXs[l] = ((x + l) * 2.f + 1) / w - 1;
+                    bs[l]    = walker.b;
+                    cs[l]    = walker.c;
+                    walker.advance();
+                } else {
+                    ndcXs[l] = ndcXs[0];
+                    bs[l]    = bs[0];
+                    cs[l]    = cs[0];
+                }
+            }
+
+            switch (kernel) {
+            case Kernel::Scalar:
+                for (uint l = 0; l < lanes; l++)
+                    samples[l] = castRay(ndcXs[l], ndcY, bs[l], cs[l]);
+                break;
+            case Kernel::Packet:
+                castRays(
+                    PPacket::load(ndcXs), ndcY, PPacket::load(bs),
+                    PPacket::load(cs), samples
+                );
+                break;
+            }
+            for (uint l = 0; l < lanes; l++) {
+                const auto intensity = lightIntensity(samples[l], a, d, s, sf);
+                row[x + l] = shadePixel(r, g, b, intensity);
+            }
+        }
+    }
+}
+
+bool Renderer::silhouetteSpan(
+    const ScanlineCoefficients &scanline, uint width, double &left,
+    double &right
+) const {
+    const double a = m_coefficients.a;
+    const auto  &s = scanline;
+
+    // Along the scanline the discriminant b^2 - 4ac is a polynomial of x too,
+    // d2 * x^2 + d1 * x + d0
+    const auto d2 = s.b1 * s.b1 - 4. * a * s.c2;
+    const auto d1 = 2. * s.b1 * s.b0 - 4. * a * s.c1;
+    const auto d0 = s.b0 * s.b0 - 4. * a * s.c0;
+
+    // Rays evaluate the discriminant in float, which is ill-conditioned near
+    // the silhouette and may report hits slightly outside the exact conic.
+    // Bounding its rounding error over the scanline keeps the span
+    // conservative.
+    const auto maxB  = std::abs(s.b1) + std::abs(s.b0);
+    const auto maxC  = std::abs(s.c2) + std::abs(s.c1) + std::abs(s.c0);
+    const auto error = ROUNDING_ULPS * FLT_EPSILON
+                     * (maxB * maxB + 4. * std::abs(a) * maxC);
+
+    if (d2 >= 0) {
+        // Not bounded along the scanline, e.g. with the camera inside
+        left  = 0;
+        right = width;
+        return true;
+    }
+
+    const auto discriminant = d1 * d1 - 4. * d2 * (d0 + error);
+    if (discriminant < 0)
+        return false;
+
+    const auto root = std::sqrt(discriminant);
+    // d2 is negative, so this gives the smaller root first
+    const auto ndcLeft  = (-d1 + root) / (2. * d2);
+    const auto ndcRight = (-d1 - root) / (2. * d2);
+
+    // Inverse of ndcX = (x * 2 + 1) / width - 1
+    left  = ((ndcLeft + 1.) * width - 1.) / 2.;
+    right = ((ndcRight + 1.) * width - 1.) / 2.;
+    return right >= 0 && left < width;
+}
+
+QRect Renderer::instanceRect(const PMat4 &pv, uint width, uint height) const {
+    const QRect frame(0, 0, width, height);
+    PVec4       min, max;
+    if (!m_instances.bounds(min, max))
+        return {};
+
+    // Pixel coordinates of the corners, as silhouetteSpan maps NDC
+    auto left   = INFINITY;
+    auto right  = -INFINITY;
+    auto bottom = INFINITY;
+    auto top    = -INFINITY;
+    for (uint i = 0; i < 8; i++) {
+        const PVec4 corner{
+            i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z
+        };
+        float clip[4];
+        for (uint r = 0; r < 4; r++)
+            clip[r] = pv[{r, 0}] * corner.x + pv[{r, 1}] * corner.y
+                    + pv[{r, 2}] * corner.z + pv[{r, 3}];
+        if (clip[3] <= 0)
+            return frame;
+        const auto x = ((clip[0] / clip[3] + 1) * width - 1) / 2;
+        const auto y = ((clip[1] / clip[3] + 1) * height - 1) / 2;
+        left         = qMin(left, x);
+        right        = qMax(right, x);
+        bottom       = qMin(bottom, y);
+        top          = qMax(top, y);
+    }
+
+    // Far outside the frame the corners would overflow int
+    const auto clamp = [](float value, uint size) {
+        return (int)std::clamp(value, -1.f, (float)size);
+    };
+    const QPoint first(
+        clamp(std::floor(left), width), clamp(std::floor(bottom), height)
+    );
+    const QPoint last(
+        clamp(std::ceil(right), width), clamp(std::ceil(top), height)
+    );
+    return QRect(first, last).intersected(frame);
+}
+
+bool Renderer::instanceSpan(uint y, double &left, double &right) const {
+    const auto &rect = m_instanceRect;
+    if ((int)y < rect.top() || (int)y > rect.bottom())
+        return false;
+    left  = rect.left();
+    right = rect.right();
+    return true;
+}
+
+void Renderer::directCoefficients(float x, float y, float &b, float &c) const {
     const float r = 1;
 
-    const auto a = m_pvme[{2, 2}];
-    const auto b = (m_pvme[{0, 2}] + m_pvme[{2, 0}]) * x
-                 + (m_pvme[{1, 2}] + m_pvme[{2, 1}]) * y
-                 + (m_pvme[{3, 2}] + m_pvme[{2, 3}]) * r;
-    const auto c = m_pvme[{0, 0}] * x * x + m_pvme[{1, 1}] * y * y
-                 + (m_pvme[{0, 1}] + m_pvme[{1, 0}]) * x * y
-                 + (m_pvme[{0, 3}] + m_pvme[{3, 0}]) * x * r
-                 + (m_pvme[{1, 3}] + m_pvme[{3, 1}]) * y * r
-                 + m_pvme[{3, 3}] * r * r;
+    b = (m_pvme[{0, 2}] + m_pvme[{2, 0}]) * x
+      + (m_pvme[{1, 2}] + m_pvme[{2, 1}]) * y
+      + (m_pvme[{3, 2}] + m_pvme[{2, 3}]) * r;
+    c = m_pvme[{0, 0}] * x * x + m_pvme[{1, 1}] * y * y
+      + (m_pvme[{0, 1}] + m_pvme[{1, 0}]) * x * y
+      + (m_pvme[{0, 3}] + m_pvme[{3, 0}]) * x * r
+      + (m_pvme[{1, 3}] + m_pvme[{3, 1}]) * y * r + m_pvme[{3, 3}] * r * r;
+}
 
-    const auto delta = b * b - 4 * a * c;
+SurfaceSample Renderer::castRay(float x, float y) // both in range <-1,+1>
+{
+    float b, c;
+    directCoefficients(x, y, b, c);
+    return castRay(x, y, b, c);
+}
 
-    if (delta < 0)
-        return 0;
+SurfaceSample Renderer::castRay(float x, float y, float b, float c) {
+    if (!m_instances.isEmpty())
+        return castInstanceRay(x, y);
 
-    const auto root = qSqrt(delta);
-    const auto z    = qMin((-b - root) / (2 * a), (-b + root) / (2 * a));
+    float z;
+    if (!rayDepth(x, y, b, c, z))
+        return {0.f, 0.f, false};
 
     const auto worldPosition = m_pvInverse * PVec4{x, y, z};
 
@@ -195,12 +1340,264 @@ float Renderer::lightIntensityAtCastRay(
     const auto toLight   = toCamera; // we assume they're in the same place
     const auto reflected = worldNormal.reflect(-toLight);
 
+    return {worldNormal.dot(toLight), reflected.dot(toCamera), true};
+}
+
+bool Renderer::rayDepth(float x, float y, float b, float c, float &z) const {
+    const auto a = m_coefficients.a;
+    switch (m_precision) {
+    case Precision::Single:
+        return nearerRoot(a, b, c, z);
+    case Precision::Mixed:
+        if (!nearZero(a, b, c))
+            return nearerRoot(a, b, c, z);
+        [[fallthrough]];
+    case Precision::Double: {
+        const ScanlineCoefficients scanline{m_coefficients, y};
+        return nearerRoot<double>(a, scanline.b(x), scanline.c(x), z);
+    }
+    }
+    return false;
+}
+
+PMask Renderer::rayDepths(
+    const PPacket &x, float y, const PPacket &b, const PPacket &c, PPacket &z
+) const {
+    const auto a = m_coefficients.a;
+
+    alignas(32) float xs[PPacket::WIDTH];
+    alignas(32) float zs[PPacket::WIDTH];
+    alignas(32) float hits[PPacket::WIDTH];
+    alignas(32) float redo[PPacket::WIDTH];
+    if (m_precision == Precision::Double) {
+        std::fill_n(zs, PPacket::WIDTH, 0.f);
+        std::fill_n(redo, PPacket::WIDTH, 1.f);
+    } else {
+        // Same evaluation order as the scalar path, the discriminant is
+        // ill-conditioned near the silhouette
+        const PPacket pa    = a;
+        const auto    delta = b * b - 4 * pa * c;
+        const auto    hit   = delta >= 0.f;
+        const auto    root  = delta.max(0.f).sqrt();
+        z = ((-b - root) / (2 * pa)).min((-b + root) / (2 * pa));
+        if (m_precision == Precision::Single)
+            return hit;
+
+        const auto error  = (float)(ROUNDING_ULPS * FLT_EPSILON)
+                          * (b * b + 4 * std::abs(a) * c.max(-c));
+        const auto unsure = (delta < error) & (-error < delta);
+        if (!unsure.any())
+            return hit;
+        z.store(zs);
+        hit.select(1.f, 0.f).store(hits);
+        unsure.select(1.f, 0.f).store(redo);
+    }
+
+    x.store(xs);
+    const ScanlineCoefficients scanline{m_coefficients, y};
+    for (uint l = 0; l < PPacket::WIDTH; l++) {
+        if (redo[l] == 0.f)
+            continue;
+        const auto hit = nearerRoot<double>(
+            a, scanline.b(xs[l]), scanline.c(xs[l]), zs[l]
+        );
+        hits[l] = hit ? 1.f : 0.f;
+    }
+    z = PPacket::load(zs);
+    return PPacket::load(hits) != 0.f;
+}
+
+SurfaceSample Renderer::castInstanceRay(float x, float y) const {
+    // Towards the point of the far plane the pixel shows
+    const auto target    = m_pvInverse * PVec4{x, y, 1};
+    const auto direction = target - m_camera;
+
+    float distance;
+    PVec4 normal;
+    if (!m_instances.intersect(m_camera, direction, distance, normal))
+        return {0.f, 0.f, false};
+
+    const auto worldPosition = m_camera + direction * distance;
+    const auto worldNormal   = normal.normalize();
+    const auto toCamera      = (m_camera - worldPosition).normalize();
+    const auto toLight       = toCamera; // we assume they're in the same place
+    const auto reflected     = worldNormal.reflect(-toLight);
+
+    return {worldNormal.dot(toLight), reflected.dot(toCamera), true};
+}
+
+void Renderer::castRays(
+    const PPacket &x, float y, const PPacket &b, const PPacket &c,
+    SurfaceSample *samples
+) // both in range <-1,+1>
+{
+    PPacket    z;
+    const auto hit = rayDepths(x, y, b, c, z);
+
+    if (!hit.any()) {
+        for (uint l = 0; l < PPacket::WIDTH; l++)
+            samples[l] = {0.f, 0.f, false};
+        return;
+    }
+
+    const auto &m      = m_pvInverse;
+    const auto  unproj = [&m, &x, y, &z](uint row) {
+        return m[{row, 0}] * x + m[{row, 2}] * z
+             + (m[{row, 1}] * y + m[{row, 3}]);
+    };
+    auto w = unproj(3);
+    w      = (w != 0.f).select(w, 1.f);
+
+    const auto worldX = unproj(0) / w;
+    const auto worldY = unproj(1) / w;
+    const auto worldZ = unproj(2) / w;
+
+    auto normalX = 2 * worldX * m_equation[{0, 0}];
+    auto normalY = 2 * worldY * m_equation[{1, 1}];
+    auto normalZ = 2 * worldZ * m_equation[{2, 2}];
+    const auto normalFactor =
+        (normalX * normalX + normalY * normalY + normalZ * normalZ).invSqrt();
+    normalX = normalX * normalFactor;
+    normalY = normalY * normalFactor;
+    normalZ = normalZ * normalFactor;
+
+    auto toCameraX = m_camera.x - worldX;
+    auto toCameraY = m_camera.y - worldY;
+    auto toCameraZ = m_camera.z - worldZ;
+    const auto toCameraFactor =
+        (toCameraX * toCameraX + toCameraY * toCameraY
+         + toCameraZ * toCameraZ)
+            .invSqrt();
+    toCameraX = toCameraX * toCameraFactor;
+    toCameraY = toCameraY * toCameraFactor;
+    toCameraZ = toCameraZ * toCameraFactor;
+
+    // Light sits at the camera, so reflected.dot(toCamera) reduces to
+    // 2 * (normal.dot(toCamera))^2 - toCamera.dot(toCamera)
+    const auto cosine =
+        normalX * toCameraX + normalY * toCameraY + normalZ * toCameraZ;
+    const auto toCameraSquared = toCameraX * toCameraX
+                               + toCameraY * toCameraY
+                               + toCameraZ * toCameraZ;
+    const auto reflectedCosine = 2 * cosine * cosine - toCameraSquared;
+
+    alignas(32) float cosines[PPacket::WIDTH];
+    alignas(32) float reflectedCosines[PPacket::WIDTH];
+    alignas(32) float hits[PPacket::WIDTH];
+    cosine.store(cosines);
+    reflectedCosine.store(reflectedCosines);
+    hit.select(1.f, 0.f).store(hits);
+    for (uint l = 0; l < PPacket::WIDTH; l++)
+        samples[l] = {cosines[l], reflectedCosines[l], hits[l] != 0.f};
+}
+
+void Renderer::reprojectRays(
+    const PPacket &x, float y, const PPacket &b, const PPacket &c,
+    uint width, uint height, bool *hits, qint32 *sourceXs, qint32 *sourceYs
+) const {
+    PPacket    z;
+    const auto hit = rayDepths(x, y, b, c, z);
+
+    const auto dot = [&x, y, &z](float px, float py, float pz, float pw) {
+        return px * x + pz * z + (py * y + pw);
+    };
+    const auto &m  = m_toLatest;
+    const auto  w  = dot(m[{3, 0}], m[{3, 1}], m[{3, 2}], m[{3, 3}]);
+    const auto  sx = (dot(m[{0, 0}], m[{0, 1}], m[{0, 2}], m[{0, 3}]) / w + 1)
+                  * (width / 2.f);
+    const auto sy = (dot(m[{1, 0}], m[{1, 1}], m[{1, 2}], m[{1, 3}]) / w + 1)
+                  * (height / 2.f);
+
+    // The sign of the polar plane's dot product flips with that of the
+    // homogeneous w the point unprojects to
+    const auto &inv    = m_pvInverse;
+    const auto &k      = m_latestCameraPlane;
+    const auto  facing = dot(k.x, k.y, k.z, k.w)
+                      * dot(inv[{3, 0}], inv[{3, 1}], inv[{3, 2}],
+                            inv[{3, 3}]);
+
+    const auto shown = hit & (0.f < facing) & (0.f < w) & (sx >= 0.f)
+                     & (sx < (float)width) & (sy >= 0.f)
+                     & (sy < (float)height);
+
+    alignas(32) float hitLanes[PPacket::WIDTH];
+    alignas(32) float xs[PPacket::WIDTH];
+    alignas(32) float ys[PPacket::WIDTH];
+    hit.select(1.f, 0.f).store(hitLanes);
+    shown.select(sx, -1.f).store(xs);
+    sy.store(ys);
+    for (uint l = 0; l < PPacket::WIDTH; l++) {
+        const auto isShown = xs[l] >= 0.f;
+        hits[l]            = hitLanes[l] != 0.f;
+        sourceXs[l]        = isShown ? (qint32)xs[l] : -1;
+        sourceYs[l]        = isShown ? (qint32)ys[l] : 0;
+    }
+}
+
+SurfaceSample
+Renderer::interpolate(const SurfaceSample *corners, float tx, float ty) {
+    const auto bilerp = [tx, ty](float c0, float c1, float c2, float c3) {
+        const auto top    = c0 + (c1 - c0) * tx;
+        const auto bottom = c2 + (c3 - c2) * tx;
+        return top + (bottom - top) * ty;
+    };
+    const auto *c = corners;
+    return {
+        bilerp(c[0].cosine, c[1].cosine, c[2].cosine, c[3].cosine),
+        bilerp(
+            c[0].reflectedCosine, c[1].reflectedCosine, c[2].reflectedCosine,
+            c[3].reflectedCosine
+        ),
+        c[0].hit
+    };
+}
+
+float Renderer::lightIntensity(
+    const SurfaceSample &sample, float ambient, float diffuse, float specular,
+    float specularFocus
+) const {
+    if (!sample.hit)
+        return 0;
+
     const auto ambientIntensity = ambient;
-    const auto diffuseIntensity = diffuse * qMax(worldNormal.dot(toLight), 0.f);
+    const auto diffuseIntensity = diffuse * qMax(sample.cosine, 0.f);
+    // Rounding may leave the cosine a little above 1, which high exponents
+    // would blow up into a visibly brighter highlight
     const auto specularIntensity =
-        specular * powf(qMax(reflected.dot(toCamera), 0.f), specularFocus);
+        specular
+        * specularPower(
+            qBound(0.f, sample.reflectedCosine, 1.f), specularFocus
+        );
 
     return qBound(
         0.f, ambientIntensity + diffuseIntensity + specularIntensity, 1.f
     );
 }
+
+float Renderer::specularPower(float cosine, float focus) const {
+    if (m_specular == Specular::Exact)
+        return powf(cosine, focus);
+
+    const auto position = cosine * SPECULAR_TABLE_SIZE;
+    const auto index    = qMin((uint)position, SPECULAR_TABLE_SIZE - 1);
+    const auto t        = position - index;
+    return m_specularTable[index]
+         + (m_specularTable[index + 1] - m_specularTable[index]) * t;
+}
+
+void Renderer::buildSpecularTable(float focus) {
+    for (uint i = 0; i <= SPECULAR_TABLE_SIZE; i++)
+        m_specularTable[i] = powf((float)i / SPECULAR_TABLE_SIZE, focus);
+    m_specularTableFocus = focus;
+
+    // Interpolation is worst somewhere between the entries
+    m_specularTableError = 0;
+    const auto samples   = SPECULAR_TABLE_SIZE * SPECULAR_ERROR_SAMPLES;
+    for (uint i = 0; i < samples; i++) {
+        const auto cosine = (i + 0.5f) / samples;
+        m_specularTableError = qMax(
+            m_specularTableError,
+            std::abs(specularPower(cosine, focus) - powf(cosine, focus))
+        );
+    }
+}
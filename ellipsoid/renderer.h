@@ -1,10 +1,24 @@
 #ifndef RENDERER_INCLUDED
 #define RENDERER_INCLUDED
 
-#include <QWidget>
+#include <functional>
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QRect>
+#include <QRegion>
+#include <QSize>
+#include <QObject>
 
 #include "../helpers.h"
 #include "../pmath.h"
+#include "accumulation_buffer.h"
+#include "frame_buffers.h"
+#include "frame_cache.h"
+#include "instance_bvh.h"
+#include "render_stats.h"
+#include "surface_buffer.h"
+#include "tile_scheduler.h"
 
 struct Params {
     // Be very careful when changing the order of members!
@@ -35,48 +49,406 @@ struct Params {
     float lightSpecular;
     float lightSpecularFocus;
 
-    inline bool operator==(const Params &other) const {
+    /// Everything but the camera that decides which surface point every pixel
+    /// sees.
+    inline bool sameModel(const Params &other) const {
         return width == other.width && height == other.height
-            && pixelGranularity == other.pixelGranularity
-            && materialRed == other.materialRed
-            && materialGreen == other.materialGreen
-            && materialBlue == other.materialBlue
             && pEqualF(positionX, other.positionX)
             && pEqualF(positionY, other.positionY)
             && pEqualF(positionZ, other.positionZ)
+            && pEqualF(scale, other.scale)
             && pEqualF(stretchX, other.stretchX)
             && pEqualF(stretchY, other.stretchY)
-            && pEqualF(stretchZ, other.stretchZ)
-            && pEqualF(cameraAngleX, other.cameraAngleX)
+            && pEqualF(stretchZ, other.stretchZ);
+    }
+    /// Everything that decides which surface point every pixel sees.
+    inline bool sameGeometry(const Params &other) const {
+        return sameModel(other) && pEqualF(cameraAngleX, other.cameraAngleX)
             && pEqualF(cameraAngleY, other.cameraAngleY)
-            && pEqualF(cameraDistance, other.cameraDistance)
+            && pEqualF(cameraDistance, other.cameraDistance);
+    }
+    /// Everything that decides the colour of a given surface point.
+    inline bool sameShading(const Params &other) const {
+        return materialRed == other.materialRed
+            && materialGreen == other.materialGreen
+            && materialBlue == other.materialBlue
             && pEqualF(lightAmbient, other.lightAmbient)
             && pEqualF(lightDiffuse, other.lightDiffuse)
             && pEqualF(lightSpecular, other.lightSpecular)
             && pEqualF(lightSpecularFocus, other.lightSpecularFocus);
     }
+
+    inline bool operator==(const Params &other) const {
+        return pixelGranularity == other.pixelGranularity
+            && sameGeometry(other) && sameShading(other);
+    }
     inline bool operator!=(const Params &other) const {
         return !((*this) == other);
     }
 };
 
-class Ellipsoid;
+/// Initial scene of the ellipsoid view, with the size left to be filled in.
+constexpr Params DEFAULT_PARAMS{
+    0,   0,   1,   255, 255, 0,    0.f,  0.f,  0.f,  1.f,
+    4.f, 2.f, 1.f, 0.f, 0.f, 10.f, 0.1f, 0.2f, 0.6f, 10.f
+};
+
+/// Coefficients of the ray-quadric equation a*z^2 + b*z + c = 0, where b and c
+/// are polynomials of the screen coordinates x and y.
+struct QuadricCoefficients {
+    float a;
+    float bX, bY, b0;
+    float cXX, cYY, cXY, cX, cY, c0;
+};
+
+/// QuadricCoefficients restricted to the scanline at 'y', where b is linear
+/// and c quadratic in x. Kept in double, there is only one per row.
+struct ScanlineCoefficients {
+    double b1, b0;     // b = b1 * x + b0
+    double c2, c1, c0; // c = (c2 * x + c1) * x + c0
+
+    inline ScanlineCoefficients(const QuadricCoefficients &q, double y)
+        : b1{q.bX}, b0{q.bY * y + q.b0}, c2{q.cXX}, c1{q.cXY * y + q.cX},
+          c0{(q.cYY * y + q.cY) * y + q.c0} {}
+
+    /// b and c at 'x', without rounding them to float.
+    inline double b(double x) const { return b1 * x + b0; }
+    inline double c(double x) const { return (c2 * x + c1) * x + c0; }
+};
+
+/// Steps b and c of a scanline from 'x' in increments of 'dx' by forward
+/// differencing, three additions per step instead of evaluating both
+/// polynomials. The error grows with the number of steps, so walks are
+/// restarted for every row of a tile.
+struct ScanlineWalker {
+    double b, c;
+    double bStep, cStep, cStep2;
+
+    inline ScanlineWalker(const ScanlineCoefficients &row, double x, double dx)
+        : b{row.b1 * x + row.b0}, c{(row.c2 * x + row.c1) * x + row.c0},
+          bStep{row.b1 * dx}, cStep{(row.c2 * (2 * x + dx) + row.c1) * dx},
+          cStep2{2 * row.c2 * dx * dx} {}
+
+    inline void advance() {
+        b     += bStep;
+        c     += cStep;
+        cStep += cStep2;
+    }
+};
+
+/// Shortest time between two renderProgressed emissions, one frame at 60 Hz.
+/// Passes finishing sooner only emit renderCompleted.
+constexpr qint64 STREAM_INTERVAL_NS = 16'000'000;
+
+/// Rows of tiles an export renders before handing them to the encoder, all
+/// of the image it holds at a time.
+constexpr uint EXPORT_BAND_TILE_ROWS = 4;
+
+/// Intervals of the specular power table over [0, 1]. Linear interpolation
+/// is off by at most about focus^2 / (8 * size^2).
+constexpr uint SPECULAR_TABLE_SIZE = 1024;
 
 class Renderer : public QObject {
     Q_OBJECT
 
+
 public:
-    Renderer(Ellipsoid *parent);
+    enum class Kernel {
+        Scalar, // one ray per call, reference implementation
+        Packet, // PPacket::WIDTH rays per call
+    };
+    enum class Specular {
+        Exact, // powf per shaded sample
+        Table, // interpolated from a table built once per specular focus
+    };
+    /// Arithmetic the discriminant b^2 - 4ac and the depth of rays are
+    /// solved in. Extreme stretches or a distant camera make the terms of the
+    /// discriminant nearly cancel, and float rounding then scatters hits and
+    /// misses around the silhouette.
+    enum class Precision {
+        Single, // float
+        Double, // double, b and c evaluated from the scanline again
+        Mixed,  // float, double where the float result is within its rounding
+                // error of 0
+    };
+
+    Renderer();
     ~Renderer();
 
-    void setupConnection();
+    /// Completed passes end up in the back buffer until swapped to the front.
+    FrameBuffers &frames();
+    /// Only its hit and miss counters may be read while rendering.
+    const FrameCache &frameCache() const;
+
+    Kernel kernel() const;
+    /// Not synchronized, change only while no render is in progress. A new
+    /// mode clears the frame cache.
+    void setKernel(Kernel value);
+
+    Specular specular() const;
+    /// Not synchronized, change only while no render is in progress. A new
+    /// mode clears the frame cache.
+    void     setSpecular(Specular value);
+    /// Largest difference between the specular table and powf, measured
+    /// between its entries when it was built for the latest focus. In
+    /// intensity before the specular coefficient, 0 for Specular::Exact.
+    float    specularTableError() const;
+
+    Precision precision() const;
+    /// Not synchronized, change only while no render is in progress. A new
+    /// mode clears the frame cache.
+    void      setPrecision(Precision value);
+
+    TileOrder tileOrder() const;
+    /// Not synchronized, change only while no render is in progress.
+    void      setTileOrder(TileOrder value);
+
+    bool adaptiveRefinement() const;
+    bool reprojection() const;
+    uint tileWidth() const;
+    uint tileHeight() const;
+    uint threadCount() const;
+
+    /// Thread-safe. Passes of older generations are dropped at the next tile
+    /// boundary instead of running to completion.
+    void cancelBefore(quint64 generation);
+    /// Not synchronized. The next pass traces everything instead of building
+    /// on the last completed one or reprojecting it.
+    void forgetLastPass();
+    /// Thread-safe. Exports of older ids stop at the next tile boundary and
+    /// leave no file behind.
+    void cancelExportsBefore(quint64 id);
+
+    const InstanceBvh &instances() const;
+    /// Traces these instead of the ellipsoid of the params, which then only
+    /// decide the camera, lighting and material. Passes are culled to the
+    /// projected box around them rather than to a silhouette and never
+    /// reprojected, the rest works as before. An empty list goes back to the
+    /// single ellipsoid. Not synchronized, change only while no render is in
+    /// progress.
+    void setInstances(const QList<Instance> &instances);
+    /// Refits the hierarchy rather than building it anew. Not synchronized,
+    /// change only while no render is in progress.
+    void moveInstance(uint index, const Instance &instance);
+
+    // Pieces of a pass for the benchmark to time and check one by one. Not
+    // synchronized, call only while no render is in progress and after one
+    // set up the scene.
+
+    /// Quadric of the latest pass, in normalized device coordinates.
+    const QuadricCoefficients &coefficients() const;
+    /// Sums of the jittered samples since the latest supersample started the
+    /// average over, -1 outside the silhouette.
+    const AccumulationBuffer  &accumulation() const;
+
+    /// Tiles of a pass in m_tileOrder. They start on the 'sub' lattice and,
+    /// except at the right edge, span whole cache lines of the pixel buffer.
+    QList<Tile> passTiles(uint width, uint height, uint sub) const;
+    /// Traces 'tiles' of a full-resolution pass from scratch into the back
+    /// buffer, which is then left as it was, without emitting anything.
+    /// 'tileStarted' and 'tileTraced', with the rays the tile traced, are
+    /// called on the worker thread around every tile.
+    void        traceTiles(
+        const QList<Tile> &tiles, const Params &params,
+        const std::function<void()>                   &tileStarted,
+        const std::function<void(quint64 raysTraced)> &tileTraced
+    );
+
+    /// b and c straight from m_pvme, the reference for ScanlineWalker.
+    void  directCoefficients(float x, float y, float &b, float &c) const;
+    /// Depths at which PPacket::WIDTH rays sharing y, with b and c from a
+    /// ScanlineWalker, hit the quadric, in m_precision. Lanes that go to
+    /// double are solved one at a time. Returns the lanes that hit.
+    PMask rayDepths(
+        const PPacket &x, float y, const PPacket &b, const PPacket &c,
+        PPacket &z
+    ) const;
+
+    /// Reference implementation, evaluates the coefficients directly.
+    SurfaceSample castRay(float x, float y);
+    /// Takes b and c of the ray from a ScanlineWalker. Traces the instances
+    /// instead if there are any, which have no use for them.
+    SurfaceSample castRay(float x, float y, float b, float c);
+    /// Same as castRay, but for PPacket::WIDTH rays sharing y. Shaded results
+    /// differ from the scalar path by at most 1/255 (one 8-bit colour level),
+    /// as long as floating-point contraction is disabled - otherwise the
+    /// ill-conditioned discriminant rounds differently near the silhouette.
+    void          castRays(
+        const PPacket &x, float y, const PPacket &b, const PPacket &c,
+        SurfaceSample *samples
+    );
+    float         lightIntensity(
+        const SurfaceSample &sample, float ambient, float diffuse,
+        float specular, float specularFocus
+    ) const;
+
+public slots:
+    /// Renders into the back buffer of frames(), emitting renderCompleted or
+    /// renderCancelled before returning. Passes taking long enough emit
+    /// renderProgressed along the way, at most once per STREAM_INTERVAL_NS.
+    void renderEllipsoid(Params params, quint64 generation);
+    /// Adds one jittered sample to every pixel the silhouette of the last
+    /// completed pass runs through, and emits renderCompleted with the number
+    /// averaged so far. That pass must have been a full-resolution one of the
+    /// same params, otherwise there is nothing to refine and the stats carry
+    /// 0 samples. Any other pass in between starts the average over.
+    /// Cancelled like renderEllipsoid, including halfway through.
+    void supersample(Params params, quint64 generation);
+    /// Renders the params at their full width and height into an image file
+    /// whose format follows the suffix of 'path', see StreamingImageWriter.
+    /// The image goes band by band, EXPORT_BAND_TILE_ROWS rows of tiles at a
+    /// time, through the tile scheduler and on to the encoder, so that only
+    /// one band is ever held. Emits exportProgressed after every band and
+    /// one of exportCompleted, exportFailed or exportCancelled before
+    /// returning. Passes queued meanwhile wait for it, and the next one
+    /// starts over without building on the last.
+    void exportImage(Params params, QString path, quint64 id);
+
+    /// When refining a completed pass, blocks whose corner samples shade
+    /// alike are interpolated instead of traced. A new mode clears the frame
+    /// cache.
+    void setAdaptiveRefinement(bool value);
+    /// When only the camera moved since the last completed pass, a coarse
+    /// pass is replaced by that frame warped into the new view, with only
+    /// the pixels it does not show traced. Later passes of the chain then
+    /// write just their samples, keeping the warped pixels around them.
+    void setReprojection(bool value);
+    /// Finished full-resolution frames are kept within this many bytes and
+    /// presented again without tracing when their params come back.
+    void setFrameCacheBudget(qint64 bytes);
+    void setTileSize(uint width, uint height);
+    void setThreadCount(uint value);
 
 private:
-    float lightIntensityAtCastRay(
-        float x, float y, float ambient, float diffuse, float specular,
-        float specularFocus
+    /// Tallies of a single tile, merged into the pass totals once it is done.
+    struct TileStats {
+        quint64 raysTraced       = 0;
+        quint64 raysHit          = 0;
+        quint64 raysCulled       = 0;
+        quint64 raysInterpolated = 0;
+        quint64 raysReprojected  = 0;
+        quint64 pixelsWritten    = 0;
+        /// Spent writing staged colours to the pixel buffer.
+        qint64  writeNs          = 0;
+        /// Traced blocks that came out different from the background.
+        QRect hitBounds;
+    };
+
+    /// What a pass can take from earlier ones instead of tracing it.
+    struct PassMode {
+        /// Samples lying on this lattice are kept from the previous pass, 0
+        /// traces all.
+        uint reusedGranularity = 0;
+        /// Nothing is traced, all samples are shaded from m_surfaces.
+        bool shadeOnly = false;
+        /// Only the pixels at sample positions are written, the rest of
+        /// every block keeps the colour reprojected into it.
+        bool sparse = false;
+        /// Frame warped into this one pixel by pixel, see reprojectRays.
+        const PixelBuffer *reprojectFrom = nullptr;
+    };
+
+    /// Stats of a pass ending now, with the chain so far and one sample per
+    /// pixel but nothing traced, written or timed on the worker threads.
+    RenderStats completedStats(quint64 generation, uint granularity) const;
+
+    bool isStale(quint64 generation) const;
+    bool isExportStale(quint64 id) const;
+
+    /// Sets up the quadric, camera and culling of 'params' for casting rays.
+    /// Returns the projection-view matrix.
+    PMat4 setUpScene(const Params &params);
+
+    /// Ends the pass begun on 'pixels' as cancelled if the frame buffers were
+    /// resized after 'params' were set, e.g. by a request overtaken by a
+    /// window resize.
+    bool fitsFrame(
+        const PixelBuffer &pixels, const Params &params, quint64 generation
+    );
+    /// Completes the pass with a frame from the cache instead of tracing it.
+    void presentCached(
+        const Params &params, const PMat4 &pv, const PixelBuffer &frame,
+        const QRect &hitBounds, quint64 generation
+    );
+
+    /// Starts the average in the accumulation buffer over from the last
+    /// completed pass, with the pixels whose neighbourhood has both hits and
+    /// misses, and -1 for the rest. Returns the bounds of the former.
+    QRect markEdges(const Tile &tile, const Params &params);
+    /// Adds jittered sample 'index' to the pixels markEdges started.
+    void  supersampleTile(
+        const Tile &tile, const Params &params, uint index, PixelBuffer &pixels,
+        TileStats &stats
+    );
+
+    void renderTile(
+        const Tile &tile, const Params &params, const PassMode &mode,
+        PixelBuffer &pixels, TileStats &stats
     );
+    void renderRow(
+        uint y, uint xBegin, uint xEnd, const Params &params,
+        const PassMode &mode, PixelBuffer &pixels, TileStats &stats
+    );
+    /// Traces every pixel of the tile, in band rows from 'bandY' of the
+    /// image up, into 'band'. Nothing is kept for later passes.
+    void exportTile(
+        const Tile &tile, const Params &params, uint bandY, PixelBuffer &band
+    );
+
+    /// Pixel columns between which the scanline crosses the silhouette, i.e.
+    /// where its discriminant is not negative. Returns false if the scanline
+    /// misses it.
+    bool silhouetteSpan(
+        const ScanlineCoefficients &scanline, uint width, double &left,
+        double &right
+    ) const;
+
+    /// Bounds of the pixels the box around the instances projects to, or the
+    /// whole frame if some of it lies behind the camera.
+    QRect instanceRect(const PMat4 &pv, uint width, uint height) const;
+    /// Like silhouetteSpan, but from m_instanceRect.
+    bool  instanceSpan(uint y, double &left, double &right) const;
+
+    /// Depth at which the ray through x and y with b and c from a
+    /// ScanlineWalker hits the quadric, in m_precision. Returns false if it
+    /// misses.
+    bool rayDepth(float x, float y, float b, float c, float &z) const;
+
+    /// Nearest of m_instances along the ray from the camera through x and y.
+    SurfaceSample castInstanceRay(float x, float y) const;
+
+    /// Pixels of the latest completed frame showing the surface points hit
+    /// by PPacket::WIDTH rays sharing y, or -1 in 'sourceXs' where it shows
+    /// something else or the ray misses. That frame had the same model, so
+    /// the depth of each of its pixels follows from its camera and need not
+    /// be stored: a point was visible if it faced that camera.
+    void reprojectRays(
+        const PPacket &x, float y, const PPacket &b, const PPacket &c,
+        uint width, uint height, bool *hits, qint32 *sourceXs,
+        qint32 *sourceYs
+    ) const;
+
+    /// Bilinear, corners in row-major order. All of them must be either hits
+    /// or misses.
+    static SurfaceSample
+    interpolate(const SurfaceSample *corners, float tx, float ty);
+    /// 'cosine', from 0 to 1, to the power of 'focus', which must be the one
+    /// the table was built for.
+    float specularPower(float cosine, float focus) const;
+    void  buildSpecularTable(float focus);
+
+    QAtomicInteger<quint64> m_newestGeneration;
+    QAtomicInteger<quint64> m_newestExport;
 
+    Kernel        m_kernel;
+    Specular      m_specular;
+    Precision     m_precision;
+    bool          m_adaptive;
+    bool          m_reprojection;
+    TileScheduler m_scheduler;
+    TileOrder     m_tileOrder;
+    uint          m_tileWidth;
+    uint          m_tileHeight;
     QElapsedTimer m_timer;
 
     PVec4 m_camera;
@@ -85,13 +457,75 @@ private:
     PMat4 m_pvme;
     PMat4 m_pvInverse;
 
-    Ellipsoid *m_ellipsoid;
+    QuadricCoefficients m_coefficients;
 
-private slots:
-    void renderEllipsoid(Params parms);
+    /// Empty unless the scene is made of instances
+    InstanceBvh m_instances;
+    /// instanceRect of the pass in progress
+    QRect       m_instanceRect;
+
+    /// Powers of SPECULAR_TABLE_SIZE + 1 evenly spaced cosines
+    float m_specularTable[SPECULAR_TABLE_SIZE + 1];
+    float m_specularTableFocus;
+    float m_specularTableError;
+
+    FrameBuffers  m_frames;
+    SurfaceBuffer m_surfaces;
+    /// m_frames.resizeCount() as of the last pass
+    uint          m_framesResizeCount;
+
+    /// Last completed pass, unless a cancelled one got in the way
+    Params  m_lastPass;
+    bool    m_lastPassValid;
+    quint64 m_chainRaysTraced;
+
+    /// Covers every non-background pixel of the last completed pass
+    QRect m_lastHitBounds;
+    QSize m_lastFrameSize;
+
+    /// Latest completed frame, kept valid across cancelled passes as long as
+    /// it is still the latest one of m_frames
+    Params             m_latestFrame;
+    const PixelBuffer *m_latestBuffer;
+    PMat4              m_latestPv;
+    PVec4              m_latestCamera;
+    /// Some of its pixels were reprojected rather than traced
+    bool               m_latestReprojected;
+
+    /// New NDC to the clip space of the latest frame
+    PMat4 m_toLatest;
+    /// Polar plane of the latest camera in new NDC. Surface points faced that
+    /// camera if their dot product with it has the sign of the w they
+    /// unproject to.
+    PVec4 m_latestCameraPlane;
+    /// Copy of the latest frame if it is the back buffer being overwritten
+    PixelBuffer m_reprojectionSource;
+
+    /// Intensity sums of supersampling, of the pixels in m_edgeTiles
+    AccumulationBuffer m_accumulation;
+    /// Samples in the sums, 0 until the first supersample pass after any
+    /// other pass
+    uint               m_samples;
+    QList<Tile>        m_edgeTiles;
+    QRect              m_edgeBounds;
+
+    FrameCache m_frameCache;
+    /// Params of the last cache lookup, at full resolution
+    Params     m_lastLookup;
 
 signals:
-    void renderCompleted();
+    /// Tiles of the pass in progress finished since the last emission, final
+    /// in the back buffer until the next pass begins. Emitted from the
+    /// scheduler's worker threads.
+    void renderProgressed(quint64 generation, QRegion finished);
+    void renderCompleted(RenderStats stats);
+    void renderCancelled(quint64 generation);
+
+    /// Rows of the image encoded so far, from the top.
+    void exportProgressed(quint64 id, uint rowsWritten);
+    void exportCompleted(quint64 id, QString path);
+    void exportFailed(quint64 id, QString error);
+    void exportCancelled(quint64 id);
 };
 
 #endif // RENDERER_INCLUDED
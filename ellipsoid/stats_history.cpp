@@ -0,0 +1,200 @@
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include "stats_history.h"
+
+QStringList StatsSummary::lines() const {
+    QStringList res;
+    res << QString("Passes: %1").arg(passes);
+    res << QString("Pass time: %1 ms mean, %2 ms max")
+               .arg(meanDurationNs / 1e6, 0, 'f', 2)
+               .arg(maxDurationNs / 1e6, 0, 'f', 2);
+    if (meanLatencyNs >= 0) {
+        res << QString("Latency: %1 ms mean, %2 ms max")
+                   .arg(meanLatencyNs / 1e6, 0, 'f', 2)
+                   .arg(maxLatencyNs / 1e6, 0, 'f', 2);
+    }
+    res << QString("Rays: %1 M/s, %2% hit, %3% culled")
+               .arg(raysPerSecond / 1e6, 0, 'f', 1)
+               .arg(hitFraction * 100, 0, 'f', 1)
+               .arg(culledFraction * 100, 0, 'f', 1);
+    res << QString("Workers busy: %1%").arg(busyFraction * 100, 0, 'f', 1);
+    res << QString("Pixel writes: %1 ms per pass, %2% of busy time")
+               .arg(meanPixelWriteNs / 1e6, 0, 'f', 2)
+               .arg(writeFraction * 100, 0, 'f', 1);
+    res << QString("Upload: %1 KiB per pass")
+               .arg(meanUploadBytes / 1024., 0, 'f', 1);
+    return res;
+}
+
+StatsHistory::StatsHistory(qsizetype capacity)
+    : m_passes{}, m_capacity{qMax(capacity, (qsizetype)1)} {}
+
+qsizetype StatsHistory::capacity() const { return m_capacity; }
+
+void StatsHistory::setCapacity(qsizetype value) {
+    m_capacity = qMax(value, (qsizetype)1);
+    if (m_passes.size() > m_capacity)
+        m_passes.remove(0, m_passes.size() - m_capacity);
+}
+
+void StatsHistory::append(const RenderStats &stats) {
+    if (m_passes.size() == m_capacity)
+        m_passes.removeFirst();
+    m_passes.append(stats);
+}
+
+void StatsHistory::clear() { m_passes.clear(); }
+
+const QList<RenderStats> &StatsHistory::passes() const { return m_passes; }
+
+StatsSummary StatsHistory::summary() const {
+    StatsSummary res{m_passes.size(), 0, 0, -1, -1, 0, 0, 0, 0, 0, 0, 0};
+
+    qint64    durationNs = 0, latencyNs = 0, uploadBytes = 0;
+    qint64    busyNs = 0, availableNs = 0, writeNs = 0;
+    quint64   raysTraced = 0, raysHit = 0, raysCulled = 0, samples = 0;
+    qsizetype presented = 0;
+    for (const auto &stats : m_passes) {
+        durationNs        += stats.durationNs;
+        res.maxDurationNs  = qMax(res.maxDurationNs, stats.durationNs);
+        if (stats.latencyNs >= 0) {
+            latencyNs        += stats.latencyNs;
+            uploadBytes      += stats.uploadBytes;
+            res.maxLatencyNs  = qMax(res.maxLatencyNs, stats.latencyNs);
+            presented++;
+        }
+        for (const auto ns : stats.threadBusyNs)
+            busyNs += ns;
+        availableNs += stats.durationNs * stats.threadBusyNs.size();
+        writeNs     += stats.pixelWriteNs;
+
+        raysTraced += stats.raysTraced;
+        raysHit    += stats.raysHit;
+        raysCulled += stats.raysCulled;
+        samples    += stats.raysTraced + stats.raysCulled
+                 + stats.raysInterpolated + stats.raysReprojected;
+    }
+
+    if (!m_passes.isEmpty()) {
+        res.meanDurationNs   = durationNs / m_passes.size();
+        res.meanPixelWriteNs = writeNs / m_passes.size();
+    }
+    if (presented > 0) {
+        res.meanLatencyNs   = latencyNs / presented;
+        res.meanUploadBytes = uploadBytes / presented;
+    }
+    if (durationNs > 0)
+        res.raysPerSecond = raysTraced * 1e9 / durationNs;
+    if (raysTraced > 0)
+        res.hitFraction = (double)raysHit / raysTraced;
+    if (samples > 0)
+        res.culledFraction = (double)raysCulled / samples;
+    if (availableNs > 0)
+        res.busyFraction = qMin((double)busyNs / availableNs, 1.);
+    if (busyNs > 0)
+        res.writeFraction = qMin((double)writeNs / busyNs, 1.);
+    return res;
+}
+
+QByteArray StatsHistory::toCsv() const {
+    QByteArray res = "generation,granularity,durationNs,shadeOnly,cached,"
+                     "samples,raysTraced,raysHit,raysCulled,raysInterpolated,"
+                     "raysReprojected,pixelsWritten,chainRaysTraced,dirtyX,"
+                     "dirtyY,dirtyWidth,dirtyHeight,threadBusyNs,"
+                     "pixelWriteNs,uploadBytes,latencyNs\n";
+    for (const auto &stats : m_passes) {
+        QStringList busy;
+        for (const auto ns : stats.threadBusyNs)
+            busy << QString::number(ns);
+
+        const QStringList fields{
+            QString::number(stats.generation),
+            QString::number(stats.pixelGranularity),
+            QString::number(stats.durationNs),
+            QString::number(stats.shadeOnly),
+            QString::number(stats.cached),
+            QString::number(stats.samples),
+            QString::number(stats.raysTraced),
+            QString::number(stats.raysHit),
+            QString::number(stats.raysCulled),
+            QString::number(stats.raysInterpolated),
+            QString::number(stats.raysReprojected),
+            QString::number(stats.pixelsWritten),
+            QString::number(stats.chainRaysTraced),
+            QString::number(stats.dirtyRect.x()),
+            QString::number(stats.dirtyRect.y()),
+            QString::number(stats.dirtyRect.width()),
+            QString::number(stats.dirtyRect.height()),
+            busy.join(';'),
+            QString::number(stats.pixelWriteNs),
+            QString::number(stats.uploadBytes),
+            QString::number(stats.latencyNs),
+        };
+        res += fields.join(',').toUtf8() + '\n';
+    }
+    return res;
+}
+
+QByteArray StatsHistory::toJson() const {
+    QJsonArray passes;
+    for (const auto &stats : m_passes) {
+        QJsonArray busy;
+        for (const auto ns : stats.threadBusyNs)
+            busy.append(ns);
+
+        QJsonObject pass;
+        pass["generation"]       = (qint64)stats.generation;
+        pass["granularity"]      = (int)stats.pixelGranularity;
+        pass["durationNs"]       = stats.durationNs;
+        pass["shadeOnly"]        = stats.shadeOnly;
+        pass["cached"]           = stats.cached;
+        pass["samples"]          = (int)stats.samples;
+        pass["raysTraced"]       = (qint64)stats.raysTraced;
+        pass["raysHit"]          = (qint64)stats.raysHit;
+        pass["raysCulled"]       = (qint64)stats.raysCulled;
+        pass["raysInterpolated"] = (qint64)stats.raysInterpolated;
+        pass["raysReprojected"]  = (qint64)stats.raysReprojected;
+        pass["pixelsWritten"]    = (qint64)stats.pixelsWritten;
+        pass["chainRaysTraced"]  = (qint64)stats.chainRaysTraced;
+        pass["dirtyRect"]        = QJsonArray{
+            stats.dirtyRect.x(), stats.dirtyRect.y(), stats.dirtyRect.width(),
+            stats.dirtyRect.height()
+        };
+        pass["threadBusyNs"] = busy;
+        pass["pixelWriteNs"] = stats.pixelWriteNs;
+        pass["uploadBytes"]  = stats.uploadBytes;
+        pass["latencyNs"]    = stats.latencyNs;
+        passes.append(pass);
+    }
+
+    const auto  summary = this->summary();
+    QJsonObject aggregate;
+    aggregate["passes"]           = summary.passes;
+    aggregate["meanDurationNs"]   = summary.meanDurationNs;
+    aggregate["maxDurationNs"]    = summary.maxDurationNs;
+    aggregate["meanLatencyNs"]    = summary.meanLatencyNs;
+    aggregate["maxLatencyNs"]     = summary.maxLatencyNs;
+    aggregate["meanUploadBytes"]  = summary.meanUploadBytes;
+    aggregate["raysPerSecond"]    = summary.raysPerSecond;
+    aggregate["hitFraction"]      = summary.hitFraction;
+    aggregate["culledFraction"]   = summary.culledFraction;
+    aggregate["busyFraction"]     = summary.busyFraction;
+    aggregate["meanPixelWriteNs"] = summary.meanPixelWriteNs;
+    aggregate["writeFraction"]    = summary.writeFraction;
+
+    QJsonObject res;
+    res["summary"] = aggregate;
+    res["passes"]  = passes;
+    return QJsonDocument{res}.toJson();
+}
+
+bool StatsHistory::save(const QString &path) const {
+    const auto data = path.endsWith(".json", Qt::CaseInsensitive) ? toJson()
+                                                                  : toCsv();
+    QFile file{path};
+    return file.open(QFile::WriteOnly | QFile::Truncate)
+        && file.write(data) == data.size();
+}
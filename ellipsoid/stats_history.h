@@ -0,0 +1,64 @@
+#ifndef STATS_HISTORY_INCLUDED
+#define STATS_HISTORY_INCLUDED
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include "render_stats.h"
+
+/// Passes kept by default, a few seconds of interaction
+constexpr qsizetype DEFAULT_STATS_HISTORY = 240;
+
+/// Aggregate of the passes in a StatsHistory.
+struct StatsSummary {
+    qsizetype passes;
+    qint64    meanDurationNs;
+    qint64    maxDurationNs;
+    /// Over the passes that were presented, -1 if none was.
+    qint64    meanLatencyNs;
+    qint64    maxLatencyNs;
+    qint64    meanUploadBytes;
+    /// Rays traced per second of pass duration.
+    double    raysPerSecond;
+    double    hitFraction;
+    double    culledFraction;
+    double    busyFraction;
+    /// Summed over the worker threads.
+    qint64    meanPixelWriteNs;
+    /// Share of the workers' busy time spent writing pixels.
+    double    writeFraction;
+
+    /// One line per figure, for an overlay.
+    QStringList lines() const;
+};
+
+/// Rolling window of the latest passes, oldest first.
+class StatsHistory {
+public:
+    StatsHistory(qsizetype capacity = DEFAULT_STATS_HISTORY);
+
+    qsizetype capacity() const;
+    /// Drops the oldest passes that no longer fit.
+    void      setCapacity(qsizetype value);
+
+    void append(const RenderStats &stats);
+    void clear();
+
+    const QList<RenderStats> &passes() const;
+    StatsSummary              summary() const;
+
+    /// One row per pass with a header, worker busy times separated by ';'.
+    QByteArray toCsv() const;
+    /// The summary and every pass.
+    QByteArray toJson() const;
+    /// JSON if the path ends with .json, CSV otherwise. Returns false if the
+    /// file could not be written.
+    bool       save(const QString &path) const;
+
+private:
+    QList<RenderStats> m_passes;
+    qsizetype          m_capacity;
+};
+
+#endif // STATS_HISTORY_INCLUDED
@@ -0,0 +1,274 @@
+#include <array>
+#include <cstdint>
+#include <utility>
+
+#include <QtEndian>
+
+#include "streaming_image_writer.h"
+
+/// Largest stored deflate block
+constexpr uint DEFLATE_STORED_BYTES = 65535;
+/// Largest multiple of 16 bytes Adler-32 sums before they could overflow
+constexpr uint ADLER_NMAX  = 5552;
+constexpr uint ADLER_PRIME = 65521;
+
+/// Entries of the TIFF directory, and where the values that do not fit in
+/// one of them go. The directory holds its entry count, 12 bytes per entry
+/// and the offset of the next one.
+constexpr quint32 TIFF_IFD     = 8;
+constexpr quint16 TIFF_ENTRIES = 13;
+constexpr quint32 TIFF_BITS    = TIFF_IFD + 6 + 12 * TIFF_ENTRIES;
+constexpr quint32 TIFF_XRES    = TIFF_BITS + 3 * 2;
+constexpr quint32 TIFF_YRES    = TIFF_XRES + 8;
+constexpr quint32 TIFF_STRIP   = TIFF_YRES + 8;
+
+constexpr quint16 TIFF_SHORT    = 3;
+constexpr quint16 TIFF_LONG     = 4;
+constexpr quint16 TIFF_RATIONAL = 5;
+
+static void appendBigEndian(QByteArray &dst, quint32 value) {
+    const quint32 be = qToBigEndian(value);
+    dst.append((const char *)&be, sizeof(be));
+}
+
+static void appendLittleEndian(QByteArray &dst, quint16 value) {
+    const quint16 le = qToLittleEndian(value);
+    dst.append((const char *)&le, sizeof(le));
+}
+
+static void appendLittleEndian(QByteArray &dst, quint32 value) {
+    const quint32 le = qToLittleEndian(value);
+    dst.append((const char *)&le, sizeof(le));
+}
+
+/// CRC-32 of PNG chunks, the one of zlib and Ethernet.
+static quint32 crc32(const QByteArray &data) {
+    static const auto table = [] {
+        std::array<quint32, 256> res;
+        for (quint32 i = 0; i < 256; i++) {
+            auto c = i;
+            for (uint k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            res[i] = c;
+        }
+        return res;
+    }();
+
+    quint32 c = 0xffffffff;
+    for (const auto byte : data)
+        c = table[(c ^ (uchar)byte) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+static quint32 adler32(quint32 adler, const char *data, qsizetype size) {
+    quint32 a = adler & 0xffff;
+    quint32 b = adler >> 16;
+    while (size > 0) {
+        const auto block = qMin<qsizetype>(size, ADLER_NMAX);
+        for (qsizetype i = 0; i < block; i++) {
+            a += (uchar)data[i];
+            b += a;
+        }
+        a    %= ADLER_PRIME;
+        b    %= ADLER_PRIME;
+        data += block;
+        size -= block;
+    }
+    return b << 16 | a;
+}
+
+bool StreamingImageWriter::formatForPath(const QString &path, Format &format) {
+    const auto suffix = path.section('.', -1).toLower();
+    if (suffix == "ppm")
+        format = Format::Ppm;
+    else if (suffix == "tif" || suffix == "tiff")
+        format = Format::Tiff;
+    else if (suffix == "png")
+        format = Format::Png;
+    else
+        return false;
+    return true;
+}
+
+StreamingImageWriter::StreamingImageWriter()
+    : m_file{}, m_format{Format::Ppm}, m_width{0}, m_height{0}, m_rows{0},
+      m_error{}, m_line{}, m_idat{}, m_adler{1} {}
+
+bool StreamingImageWriter::open(
+    const QString &path, Format format, uint width, uint height
+) {
+    m_format = format;
+    m_width  = width;
+    m_height = height;
+    m_rows   = 0;
+    m_error.clear();
+    m_idat.clear();
+    m_adler = 1;
+
+    if (width == 0 || height == 0)
+        return fail("Empty image");
+    // Single strip offsets and byte counts are 32-bit
+    const auto bytes = (quint64)width * height * 3;
+    if (format == Format::Tiff && TIFF_STRIP + bytes > UINT32_MAX)
+        return fail("Image too large for an uncompressed TIFF");
+
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly))
+        return fail(m_file.errorString());
+
+    // PNG rows start with their filter type, 0 for none
+    const auto filter = format == Format::Png ? 1 : 0;
+    m_line.fill(0, filter + width * 3);
+
+    switch (format) {
+    case Format::Ppm: {
+        const auto header = QString("P6\n%1 %2\n255\n").arg(width).arg(height);
+        return write(header.toLatin1());
+    }
+    case Format::Tiff:
+        return write(tiffHeader());
+    case Format::Png: {
+        QByteArray header;
+        appendBigEndian(header, width);
+        appendBigEndian(header, height);
+        // 8 bits per channel, RGB, deflate, adaptive filters, no interlace
+        header.append("\x08\x02\x00\x00\x00", 5);
+        // zlib stream of a 32 KiB window, fastest level
+        m_idat.append("\x78\x01", 2);
+        return write("\x89PNG\r\n\x1a\n") && writePngChunk("IHDR", header);
+    }
+    }
+    return false;
+}
+
+bool StreamingImageWriter::writeRow(const Pixel *pixels) {
+    if (!m_error.isEmpty())
+        return false;
+    if (m_rows == m_height)
+        return fail("More rows than the image has");
+    m_rows++;
+
+    auto        rgb      = (uchar *)m_line.data() + (m_format == Format::Png);
+    const auto  channels = (const uchar *)pixels;
+    const auto &format   = PIXEL_BUFFER_TRAITS;
+    for (uint x = 0; x < m_width; x++) {
+        const auto pixel = channels + x * COLOR_CHANNELS;
+        rgb[x * 3 + 0]   = pixel[format.redByte];
+        rgb[x * 3 + 1]   = pixel[format.greenByte];
+        rgb[x * 3 + 2]   = pixel[format.blueByte];
+    }
+    if (m_format != Format::Png)
+        return write(m_line);
+
+    m_adler = adler32(m_adler, m_line.constData(), m_line.size());
+    for (qsizetype begin = 0; begin < m_line.size();) {
+        const auto size = qMin<qsizetype>(
+            m_line.size() - begin, DEFLATE_STORED_BYTES
+        );
+        const auto last = m_rows == m_height && begin + size == m_line.size();
+        m_idat.append(last ? '\x01' : '\x00');
+        appendLittleEndian(m_idat, (quint16)size);
+        appendLittleEndian(m_idat, (quint16)~size);
+        m_idat.append(m_line.constData() + begin, size);
+        begin += size;
+    }
+    if (m_idat.size() < PNG_CHUNK_BYTES)
+        return true;
+    return writePngChunk("IDAT", std::exchange(m_idat, {}));
+}
+
+bool StreamingImageWriter::commit() {
+    if (!m_error.isEmpty())
+        return false;
+    if (m_rows != m_height)
+        return fail("Not every row was written");
+    if (m_format == Format::Png) {
+        appendBigEndian(m_idat, m_adler);
+        if (!writePngChunk("IDAT", std::exchange(m_idat, {}))
+            || !writePngChunk("IEND", {}))
+            return false;
+    }
+    if (!m_file.commit())
+        return fail(m_file.errorString());
+    return true;
+}
+
+void StreamingImageWriter::cancel() {
+    m_file.cancelWriting();
+    m_file.commit();
+}
+
+uint StreamingImageWriter::rowsWritten() const { return m_rows; }
+
+QString StreamingImageWriter::errorString() const { return m_error; }
+
+bool StreamingImageWriter::fail(const QString &error) {
+    m_error = error;
+    if (m_file.isOpen())
+        cancel();
+    return false;
+}
+
+bool StreamingImageWriter::write(const QByteArray &data) {
+    if (m_file.write(data) != data.size())
+        return fail(m_file.errorString());
+    return true;
+}
+
+QByteArray StreamingImageWriter::tiffHeader() const {
+    QByteArray res{"II*\0", 4};
+    appendLittleEndian(res, TIFF_IFD);
+
+    appendLittleEndian(res, TIFF_ENTRIES);
+    const auto entry = [&](quint16 tag, quint16 type, quint32 count,
+                           quint32 value) {
+        appendLittleEndian(res, tag);
+        appendLittleEndian(res, type);
+        appendLittleEndian(res, count);
+        // Short values sit in the first two bytes of the field
+        if (type == TIFF_SHORT && count == 1) {
+            appendLittleEndian(res, (quint16)value);
+            appendLittleEndian(res, (quint16)0);
+        } else {
+            appendLittleEndian(res, value);
+        }
+    };
+    // Tags in ascending order, as readers expect them
+    const quint32 stripBytes = m_width * m_height * 3;
+    entry(256, TIFF_LONG, 1, m_width);       // ImageWidth
+    entry(257, TIFF_LONG, 1, m_height);      // ImageLength
+    entry(258, TIFF_SHORT, 3, TIFF_BITS);    // BitsPerSample
+    entry(259, TIFF_SHORT, 1, 1);            // Compression, none
+    entry(262, TIFF_SHORT, 1, 2);            // Photometric, RGB
+    entry(273, TIFF_LONG, 1, TIFF_STRIP);    // StripOffsets
+    entry(277, TIFF_SHORT, 1, 3);            // SamplesPerPixel
+    entry(278, TIFF_LONG, 1, m_height);      // RowsPerStrip
+    entry(279, TIFF_LONG, 1, stripBytes);    // StripByteCounts
+    entry(282, TIFF_RATIONAL, 1, TIFF_XRES); // XResolution
+    entry(283, TIFF_RATIONAL, 1, TIFF_YRES); // YResolution
+    entry(284, TIFF_SHORT, 1, 1);            // PlanarConfiguration
+    entry(296, TIFF_SHORT, 1, 2);            // ResolutionUnit, inch
+    // No further directory
+    appendLittleEndian(res, (quint32)0);
+
+    for (uint i = 0; i < 3; i++)
+        appendLittleEndian(res, (quint16)8);
+    // 72 dpi both ways
+    for (uint i = 0; i < 2; i++) {
+        appendLittleEndian(res, (quint32)72);
+        appendLittleEndian(res, (quint32)1);
+    }
+    return res;
+}
+
+bool StreamingImageWriter::writePngChunk(
+    const char *type, const QByteArray &data
+) {
+    QByteArray chunk;
+    appendBigEndian(chunk, data.size());
+    chunk.append(type, 4);
+    chunk.append(data);
+    // The checksum covers the type and the data, not the length
+    appendBigEndian(chunk, crc32(chunk.mid(4)));
+    return write(chunk);
+}
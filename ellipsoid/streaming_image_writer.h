@@ -0,0 +1,65 @@
+#ifndef STREAMING_IMAGE_WRITER_INCLUDED
+#define STREAMING_IMAGE_WRITER_INCLUDED
+
+#include <QByteArray>
+#include <QSaveFile>
+#include <QString>
+
+#include "pixel_buffer.h"
+
+/// Uncompressed scanlines a PNG IDAT chunk collects before it is written
+constexpr qsizetype PNG_CHUNK_BYTES = 1 << 20;
+
+/// Encodes an RGB8 image handed over one row at a time, top row first, so
+/// that no more than a row of it is ever held. The file only replaces the
+/// one at the path once every row is written and committed.
+class StreamingImageWriter {
+public:
+    enum class Format {
+        Ppm,  // binary PPM, a header followed by the raw rows
+        Tiff, // baseline TIFF, uncompressed in a single strip
+        Png,  // PNG, its zlib stream made of stored blocks
+    };
+
+    /// Picks the format by suffix, false if none matches.
+    static bool formatForPath(const QString &path, Format &format);
+
+    StreamingImageWriter();
+
+    /// Writes the header for an image of that size.
+    bool open(const QString &path, Format format, uint width, uint height);
+    /// 'pixels' holds the width of the image, in PIXEL_BUFFER_FORMAT. Alpha
+    /// is dropped.
+    bool writeRow(const Pixel *pixels);
+    /// Finishes the file once every row is written and moves it in place.
+    bool commit();
+    /// Drops the file, leaving whatever was at the path before.
+    void cancel();
+
+    uint    rowsWritten() const;
+    QString errorString() const;
+
+private:
+    bool fail(const QString &error);
+    bool write(const QByteArray &data);
+
+    /// Header and the directory of the single strip.
+    QByteArray tiffHeader() const;
+    /// Appends a chunk with its length and checksum.
+    bool       writePngChunk(const char *type, const QByteArray &data);
+
+    QSaveFile m_file;
+    Format    m_format;
+    uint      m_width;
+    uint      m_height;
+    uint      m_rows;
+    QString   m_error;
+
+    /// RGB of the row being written, after a PNG filter byte
+    QByteArray m_line;
+    /// Stored deflate blocks waiting for the next IDAT chunk
+    QByteArray m_idat;
+    quint32    m_adler;
+};
+
+#endif // STREAMING_IMAGE_WRITER_INCLUDED
@@ -0,0 +1,101 @@
+#ifndef STRIDED_BUFFER_INCLUDED
+#define STRIDED_BUFFER_INCLUDED
+
+#include <QtGlobal>
+
+#include "buffer_pool.h"
+
+/// Rows of T padded to a multiple of ALIGNMENT elements, in a block from
+/// BufferPool. Buffers of the same width padded alike keep their rows in step,
+/// so tiles covering whole cache lines of one cover whole cache lines of all.
+template <typename T, uint ALIGNMENT> class StridedBuffer {
+public:
+    StridedBuffer();
+    ~StridedBuffer();
+
+    StridedBuffer(const StridedBuffer &)            = delete;
+    StridedBuffer &operator=(const StridedBuffer &) = delete;
+
+    /// Returns false if the size did not change. Contents are undefined
+    /// otherwise.
+    bool resize(uint width, uint height);
+
+    uint   width() const;
+    uint   height() const;
+    /// Distance between the starts of consecutive rows, in elements.
+    uint   stride() const;
+    /// Elements of all rows, padding included.
+    size_t size() const;
+
+    T       *row(uint y);
+    const T *constRow(uint y) const;
+
+private:
+    uint   m_width;
+    uint   m_height;
+    uint   m_stride;
+    /// Size class of the block, see BufferPool
+    size_t m_capacity;
+    T     *m_data;
+};
+
+template <typename T, uint ALIGNMENT>
+StridedBuffer<T, ALIGNMENT>::StridedBuffer()
+    : m_width{0}, m_height{0}, m_stride{0}, m_capacity{0}, m_data{nullptr} {}
+
+template <typename T, uint ALIGNMENT>
+StridedBuffer<T, ALIGNMENT>::~StridedBuffer() {
+    BufferPool::instance().release(m_data, m_capacity);
+}
+
+template <typename T, uint ALIGNMENT>
+bool StridedBuffer<T, ALIGNMENT>::resize(uint width, uint height) {
+    if (width == m_width && height == m_height)
+        return false;
+
+    m_width  = width;
+    m_height = height;
+    m_stride = (width + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    // Sizes of the same class share the block
+    const auto bytes = size() * sizeof(T);
+    if (BufferPool::sizeClass(bytes) != m_capacity) {
+        auto &pool = BufferPool::instance();
+        pool.release(m_data, m_capacity);
+        m_capacity = BufferPool::sizeClass(bytes);
+        m_data     = (T *)pool.acquire(bytes);
+    }
+    return true;
+}
+
+template <typename T, uint ALIGNMENT>
+uint StridedBuffer<T, ALIGNMENT>::width() const {
+    return m_width;
+}
+
+template <typename T, uint ALIGNMENT>
+uint StridedBuffer<T, ALIGNMENT>::height() const {
+    return m_height;
+}
+
+template <typename T, uint ALIGNMENT>
+uint StridedBuffer<T, ALIGNMENT>::stride() const {
+    return m_stride;
+}
+
+template <typename T, uint ALIGNMENT>
+size_t StridedBuffer<T, ALIGNMENT>::size() const {
+    return (size_t)m_stride * m_height;
+}
+
+template <typename T, uint ALIGNMENT>
+T *StridedBuffer<T, ALIGNMENT>::row(uint y) {
+    return m_data + (size_t)y * m_stride;
+}
+
+template <typename T, uint ALIGNMENT>
+const T *StridedBuffer<T, ALIGNMENT>::constRow(uint y) const {
+    return m_data + (size_t)y * m_stride;
+}
+
+#endif // STRIDED_BUFFER_INCLUDED
@@ -0,0 +1,9 @@
+#include "surface_buffer.h"
+
+void SurfaceBuffer::resize(uint width, uint height) {
+    if (!StridedBuffer::resize(width, height))
+        return;
+    const auto samples = row(0);
+    for (size_t i = 0; i < size(); i++)
+        samples[i] = {0.f, 0.f, false};
+}
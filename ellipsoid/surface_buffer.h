@@ -0,0 +1,31 @@
+#ifndef SURFACE_BUFFER_INCLUDED
+#define SURFACE_BUFFER_INCLUDED
+
+#include <QtGlobal>
+
+#include "pixel_buffer.h"
+#include "strided_buffer.h"
+
+/// What lighting needs to know about the surface seen through a pixel. The
+/// light sits at the camera, so the normal and view vectors reduce to two
+/// cosines.
+struct SurfaceSample {
+    /// normal.dot(toCamera)
+    float cosine;
+    /// reflected light direction dot toCamera
+    float reflectedCosine;
+    bool  hit;
+};
+
+/// Per-pixel geometry of the latest pass, so that lighting changes can be
+/// shaded without intersecting rays again. Only pixels at sample positions
+/// are written, the ones a block of pixels is shaded from. Rows are padded
+/// like those of the pixel buffer, so that tiles cover whole cache lines of
+/// both.
+class SurfaceBuffer : public StridedBuffer<SurfaceSample, CACHE_LINE_PIXELS> {
+public:
+    /// A new size clears every sample to a miss.
+    void resize(uint width, uint height);
+};
+
+#endif // SURFACE_BUFFER_INCLUDED
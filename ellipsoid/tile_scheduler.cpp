@@ -0,0 +1,177 @@
+#include <utility>
+
+#include "tile_scheduler.h"
+
+TileScheduler::TileScheduler(uint threadCount)
+    : m_workers{}, m_mutex{}, m_passStarted{}, m_passFinished{},
+      m_function{nullptr}, m_pass{0}, m_activeWorkers{0}, m_quit{false} {
+    start(threadCount);
+}
+
+TileScheduler::~TileScheduler() { stop(); }
+
+uint TileScheduler::threadCount() const { return m_workers.size(); }
+
+void TileScheduler::setThreadCount(uint value) {
+    if (value == threadCount())
+        return;
+    stop();
+    start(value);
+}
+
+void TileScheduler::run(
+    const QList<Tile> &tiles, const TileFunction &function
+) {
+    for (auto worker : m_workers)
+        worker->busyNs = 0;
+    if (tiles.isEmpty())
+        return;
+
+    // Contiguous chunks keep neighbouring tiles on the same core until
+    // stealing kicks in
+    const uint workers = m_workers.size();
+    const uint chunk   = (tiles.size() + workers - 1) / workers;
+    for (uint i = 0; i < workers; i++) {
+        QMutexLocker lock{&m_workers[i]->mutex};
+        const uint   begin = qMin<uint>(i * chunk, tiles.size());
+        const uint   end   = qMin<uint>(begin + chunk, tiles.size());
+        m_workers[i]->tiles = tiles.mid(begin, end - begin);
+    }
+
+    QMutexLocker lock{&m_mutex};
+    m_function      = &function;
+    m_activeWorkers = workers;
+    m_pass++;
+    m_passStarted.wakeAll();
+    while (m_activeWorkers > 0)
+        m_passFinished.wait(&m_mutex);
+    m_function = nullptr;
+}
+
+QList<qint64> TileScheduler::busyNs() const {
+    QList<qint64> res;
+    res.reserve(m_workers.size());
+    for (const auto worker : m_workers)
+        res.append(worker->busyNs);
+    return res;
+}
+
+void TileScheduler::start(uint threadCount) {
+    m_quit = false;
+    for (uint i = 0; i < qMax(threadCount, 1u); i++) {
+        auto worker    = new Worker{};
+        worker->thread = QThread::create([this, i]() { workerLoop(i); });
+        m_workers.append(worker);
+    }
+    for (auto worker : m_workers)
+        worker->thread->start();
+}
+
+void TileScheduler::stop() {
+    {
+        QMutexLocker lock{&m_mutex};
+        m_quit = true;
+        m_passStarted.wakeAll();
+    }
+    for (auto worker : m_workers) {
+        worker->thread->wait();
+        delete worker->thread;
+        delete worker;
+    }
+    m_workers.clear();
+}
+
+void TileScheduler::workerLoop(uint index) {
+    quint64 lastPass = 0;
+    forever {
+        const TileFunction *function;
+        {
+            QMutexLocker lock{&m_mutex};
+            while (!m_quit && m_pass == lastPass)
+                m_passStarted.wait(&m_mutex);
+            if (m_quit)
+                return;
+            lastPass = m_pass;
+            function = m_function;
+        }
+
+        // Only this worker writes its busy time, run() reads it once all
+        // of them are done
+        Tile          tile;
+        QElapsedTimer timer;
+        while (takeOwn(index, tile) || steal(index, tile)) {
+            timer.start();
+            (*function)(tile);
+            m_workers[index]->busyNs += timer.nsecsElapsed();
+        }
+
+        QMutexLocker lock{&m_mutex};
+        if (--m_activeWorkers == 0)
+            m_passFinished.wakeAll();
+    }
+}
+
+bool TileScheduler::takeOwn(uint index, Tile &tile) {
+    auto         worker = m_workers[index];
+    QMutexLocker lock{&worker->mutex};
+    if (worker->tiles.isEmpty())
+        return false;
+    tile = worker->tiles.takeFirst();
+    return true;
+}
+
+bool TileScheduler::steal(uint thief, Tile &tile) {
+    const uint workers = m_workers.size();
+    for (uint offset = 1; offset < workers; offset++) {
+        auto         victim = m_workers[(thief + offset) % workers];
+        QMutexLocker lock{&victim->mutex};
+        if (victim->tiles.isEmpty())
+            continue;
+        tile = victim->tiles.takeLast();
+        return true;
+    }
+    return false;
+}
+
+quint64 tileOrderKey(
+    TileOrder order, uint column, uint row, uint columns, uint rows
+) {
+    switch (order) {
+    case TileOrder::RowMajor:
+        return (quint64)row * columns + column;
+    case TileOrder::Morton: {
+        quint64 key = 0;
+        for (uint bit = 0; bit < 32; bit++) {
+            key |= (quint64)((column >> bit) & 1) << (2 * bit);
+            key |= (quint64)((row >> bit) & 1) << (2 * bit + 1);
+        }
+        return key;
+    }
+    case TileOrder::Hilbert: {
+        // Over the smallest power of two square holding the grid, the curve
+        // then skips the missing tiles
+        uint side = 1;
+        while (side < columns || side < rows)
+            side *= 2;
+
+        quint64 key = 0;
+        uint    x = column, y = row;
+        for (uint s = side / 2; s > 0; s /= 2) {
+            const uint rx = (x & s) ? 1 : 0;
+            const uint ry = (y & s) ? 1 : 0;
+            key          += (quint64)s * s * ((3 * rx) ^ ry);
+            // Rotates the quadrant so that the curve enters and leaves it
+            // next to its neighbours
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = side - 1 - x;
+                    y = side - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return key;
+    }
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef TILE_SCHEDULER_INCLUDED
+#define TILE_SCHEDULER_INCLUDED
+
+#include <functional>
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+struct Tile {
+    uint x, y;
+    uint width, height;
+};
+
+/// Order in which the tiles of a pass are handed out. Workers take
+/// contiguous runs of it, so along a space-filling curve each of them covers
+/// a compact patch of the frame rather than a band of rows.
+enum class TileOrder {
+    RowMajor, // bottom row of tiles first, each from left to right
+    Morton,   // Z-order curve over the tile grid
+    Hilbert,  // Hilbert curve over the tile grid
+};
+
+/// Position along 'order' of the tile at 'column' and 'row' of a grid with
+/// the given number of columns and rows.
+quint64 tileOrderKey(
+    TileOrder order, uint column, uint row, uint columns, uint rows
+);
+
+/// Persistent pool of worker threads executing one pass of tiles at a time.
+/// Every worker owns a deque of tiles: it takes work from the front of its own
+/// deque and, once that runs dry, steals from the back of the others.
+class TileScheduler {
+public:
+    typedef std::function<void(const Tile &tile)> TileFunction;
+
+    TileScheduler(uint threadCount);
+    ~TileScheduler();
+
+    uint threadCount() const;
+    /// Restarts the pool, must not be called while a pass is running.
+    void setThreadCount(uint value);
+
+    /// Splits the tiles between workers and blocks until all are processed.
+    void run(const QList<Tile> &tiles, const TileFunction &function);
+    /// Time every worker spent in the tile function during the last run, the
+    /// rest of it went to waiting for work or for the others to finish.
+    QList<qint64> busyNs() const;
+
+private:
+    struct Worker {
+        QMutex      mutex;
+        QList<Tile> tiles;
+        QThread    *thread;
+        qint64      busyNs;
+    };
+
+    void start(uint threadCount);
+    void stop();
+
+    void workerLoop(uint index);
+    bool takeOwn(uint index, Tile &tile);
+    bool steal(uint thief, Tile &tile);
+
+    QList<Worker *> m_workers;
+
+    QMutex              m_mutex;
+    QWaitCondition      m_passStarted;
+    QWaitCondition      m_passFinished;
+    const TileFunction *m_function;
+    quint64             m_pass;
+    uint                m_activeWorkers;
+    bool                m_quit;
+};
+
+#endif // TILE_SCHEDULER_INCLUDED
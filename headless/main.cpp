@@ -0,0 +1,447 @@
+#include <climits>
+#include <initializer_list>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QTextStream>
+
+#include "../ellipsoid/renderer.h"
+#include "../ellipsoid/stats_history.h"
+
+constexpr uint DEFAULT_SIZE = 1024;
+
+/// Scene keys accepted both as --key=value options and as key=value lines of
+/// a --params file.
+struct ParamKey {
+    const char *name;
+    const char *valueName;
+    const char *description;
+};
+
+constexpr ParamKey PARAM_KEYS[] = {
+    {"width", "pixels", "Image width."},
+    {"height", "pixels", "Image height."},
+    {"granularity", "pixels", "Side of the pixel blocks sharing one ray."},
+    {"material", "r,g,b", "Surface colour, 0-255 per channel."},
+    {"position", "x,y,z", "Ellipsoid centre."},
+    {"scale", "factor", "Uniform scale of the ellipsoid."},
+    {"stretch", "x,y,z", "Semi-axes of the ellipsoid."},
+    {"camera-angle", "x,y", "Camera orbit angles, in radians."},
+    {"camera-distance", "units", "Camera distance from the origin."},
+    {"ambient", "k", "Ambient light coefficient."},
+    {"diffuse", "k", "Diffuse light coefficient."},
+    {"specular", "k", "Specular light coefficient."},
+    {"specular-focus", "n", "Specular exponent."},
+};
+
+/// Comma separated, one per member, none written unless all of them parse.
+static bool parseFloats(
+    const QString &value, Params &params,
+    std::initializer_list<float Params::*> members
+) {
+    const auto parts = value.split(',');
+    if (parts.size() != (qsizetype)members.size())
+        return false;
+    float parsed[3]; // Vectors have at most three components
+    for (qsizetype i = 0; i < parts.size(); i++) {
+        bool ok;
+        parsed[i] = parts[i].trimmed().toFloat(&ok);
+        if (!ok)
+            return false;
+    }
+    auto component = parsed;
+    for (const auto member : members)
+        params.*member = *component++;
+    return true;
+}
+
+static bool parseUint(const QString &value, uint &dst, uint min, uint max) {
+    bool       ok;
+    const uint res = value.trimmed().toUInt(&ok);
+    if (!ok || res < min || res > max)
+        return false;
+    dst = res;
+    return true;
+}
+
+static bool setParam(Params &params, const QString &key, const QString &value) {
+    if (key == "width")
+        return parseUint(value, params.width, 1, UINT16_MAX);
+    if (key == "height")
+        return parseUint(value, params.height, 1, UINT16_MAX);
+    if (key == "granularity")
+        return parseUint(value, params.pixelGranularity, 1, UINT16_MAX);
+    if (key == "material") {
+        const auto parts = value.split(',');
+        uint       rgb[3];
+        if (parts.size() != 3)
+            return false;
+        for (int i = 0; i < 3; i++)
+            if (!parseUint(parts[i], rgb[i], 0, 255))
+                return false;
+        params.materialRed   = rgb[0];
+        params.materialGreen = rgb[1];
+        params.materialBlue  = rgb[2];
+        return true;
+    }
+    if (key == "position")
+        return parseFloats(
+            value, params,
+            {&Params::positionX, &Params::positionY, &Params::positionZ}
+        );
+    if (key == "scale")
+        return parseFloats(value, params, {&Params::scale});
+    if (key == "stretch")
+        return parseFloats(
+            value, params,
+            {&Params::stretchX, &Params::stretchY, &Params::stretchZ}
+        );
+    if (key == "camera-angle")
+        return parseFloats(
+            value, params, {&Params::cameraAngleX, &Params::cameraAngleY}
+        );
+    if (key == "camera-distance")
+        return parseFloats(value, params, {&Params::cameraDistance});
+    if (key == "ambient")
+        return parseFloats(value, params, {&Params::lightAmbient});
+    if (key == "diffuse")
+        return parseFloats(value, params, {&Params::lightDiffuse});
+    if (key == "specular")
+        return parseFloats(value, params, {&Params::lightSpecular});
+    if (key == "specular-focus")
+        return parseFloats(value, params, {&Params::lightSpecularFocus});
+    return false;
+}
+
+/// Lines of the form key=value, blank lines and lines starting with '#' are
+/// skipped.
+static bool readParams(const QString &path, Params &params, QString &error) {
+    QFile file{path};
+    if (!file.open(QFile::ReadOnly | QFile::Text)) {
+        error = QString("%1: %2").arg(path, file.errorString());
+        return false;
+    }
+
+    QTextStream in{&file};
+    for (int line = 1; !in.atEnd(); line++) {
+        const auto text = in.readLine().trimmed();
+        if (text.isEmpty() || text.startsWith('#'))
+            continue;
+        const auto separator = text.indexOf('=');
+        if (separator < 0
+            || !setParam(
+                params, text.left(separator).trimmed(),
+                text.mid(separator + 1)
+            )) {
+            error = QString("%1:%2: invalid line '%3'")
+                        .arg(path)
+                        .arg(line)
+                        .arg(text);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("ellipsoid_headless");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Renders the ellipsoid on the CPU without a window or GL context."
+    );
+    parser.addHelpOption();
+
+    const QCommandLineOption paramsOption{
+        "params", "Reads key=value scene lines, overridden by options.", "file"
+    };
+    const QCommandLineOption outputOption{
+        {"o", "output"},
+        "Saves the image, the format follows the suffix (ppm, png, ...).",
+        "file"
+    };
+    const QCommandLineOption exportOption{
+        "export",
+        "Traces every pixel straight into this image a band of tiles at a "
+        "time, without holding the whole frame, instead of rendering passes. "
+        "Writes ppm, tif or png.",
+        "file"
+    };
+    const QCommandLineOption statsOption{
+        "stats",
+        "Writes the stats of every pass, as JSON if the file ends with .json "
+        "and as CSV otherwise.",
+        "file"
+    };
+    const QCommandLineOption refineOption{
+        "refine",
+        "Refines progressively from the granularity down to single pixels, "
+        "like the interactive view does."
+    };
+    const QCommandLineOption kernelOption{
+        "kernel", "Ray caster kernel, scalar or packet.", "name", "packet"
+    };
+    const QCommandLineOption specularModeOption{
+        "specular-mode", "Specular power, exact or table.", "name", "exact"
+    };
+    const QCommandLineOption precisionOption{
+        "precision", "Quadric solver precision, single, double or mixed.",
+        "name", "mixed"
+    };
+    const QCommandLineOption orderOption{
+        "order", "Tile order, row, morton or hilbert.", "name", "row"
+    };
+    const QCommandLineOption samplesOption{
+        "samples",
+        "Supersamples the silhouette of the last pass up to this many samples "
+        "per pixel, like the idle interactive view does.",
+        "count", "1"
+    };
+    const QCommandLineOption instancesOption{
+        "instances",
+        "Renders this many ellipsoids on a lattice instead of the one of the "
+        "scene keys.",
+        "count"
+    };
+    const QCommandLineOption adaptiveOption{
+        "adaptive", "Interpolates flat blocks while refining."
+    };
+    const QCommandLineOption threadsOption{
+        "threads", "Worker threads, ideal thread count by default.", "count"
+    };
+    const QCommandLineOption tileOption{
+        "tile", "Tile size of the scheduler.", "widthxheight"
+    };
+    for (const auto &option :
+         {paramsOption, outputOption, exportOption, statsOption, refineOption,
+          kernelOption, specularModeOption, precisionOption, orderOption,
+          samplesOption, instancesOption, adaptiveOption, threadsOption,
+          tileOption})
+        parser.addOption(option);
+    for (const auto &key : PARAM_KEYS)
+        parser.addOption({key.name, key.description, key.valueName});
+    parser.process(app);
+
+    QTextStream err{stderr};
+    QTextStream out{stdout};
+
+    auto params   = DEFAULT_PARAMS;
+    params.width  = DEFAULT_SIZE;
+    params.height = DEFAULT_SIZE;
+
+    QString error;
+    if (parser.isSet(paramsOption)
+        && !readParams(parser.value(paramsOption), params, error)) {
+        err << error << Qt::endl;
+        return 1;
+    }
+    for (const auto &key : PARAM_KEYS) {
+        if (parser.isSet(key.name)
+            && !setParam(params, key.name, parser.value(key.name))) {
+            err << "Invalid --" << key.name << " value '"
+                << parser.value(key.name) << "'" << Qt::endl;
+            return 1;
+        }
+    }
+
+    Renderer renderer;
+
+    const auto kernel = parser.value(kernelOption);
+    if (kernel == "scalar")
+        renderer.setKernel(Renderer::Kernel::Scalar);
+    else if (kernel == "packet")
+        renderer.setKernel(Renderer::Kernel::Packet);
+    else {
+        err << "Unknown kernel '" << kernel << "'" << Qt::endl;
+        return 1;
+    }
+
+    const auto specularMode = parser.value(specularModeOption);
+    if (specularMode == "exact")
+        renderer.setSpecular(Renderer::Specular::Exact);
+    else if (specularMode == "table")
+        renderer.setSpecular(Renderer::Specular::Table);
+    else {
+        err << "Unknown specular mode '" << specularMode << "'" << Qt::endl;
+        return 1;
+    }
+
+    const auto precision = parser.value(precisionOption);
+    if (precision == "single")
+        renderer.setPrecision(Renderer::Precision::Single);
+    else if (precision == "double")
+        renderer.setPrecision(Renderer::Precision::Double);
+    else if (precision == "mixed")
+        renderer.setPrecision(Renderer::Precision::Mixed);
+    else {
+        err << "Unknown precision '" << precision << "'" << Qt::endl;
+        return 1;
+    }
+
+    const auto order = parser.value(orderOption);
+    if (order == "row")
+        renderer.setTileOrder(TileOrder::RowMajor);
+    else if (order == "morton")
+        renderer.setTileOrder(TileOrder::Morton);
+    else if (order == "hilbert")
+        renderer.setTileOrder(TileOrder::Hilbert);
+    else {
+        err << "Unknown tile order '" << order << "'" << Qt::endl;
+        return 1;
+    }
+
+    if (parser.isSet(threadsOption)) {
+        uint threads;
+        if (!parseUint(parser.value(threadsOption), threads, 1, 1024)) {
+            err << "Invalid --threads value" << Qt::endl;
+            return 1;
+        }
+        renderer.setThreadCount(threads);
+    }
+    if (parser.isSet(tileOption)) {
+        const auto parts = parser.value(tileOption).split('x');
+        uint       width, height;
+        if (parts.size() != 2 || !parseUint(parts[0], width, 1, UINT16_MAX)
+            || !parseUint(parts[1], height, 1, UINT16_MAX)) {
+            err << "Invalid --tile value" << Qt::endl;
+            return 1;
+        }
+        renderer.setTileSize(width, height);
+    }
+    renderer.setAdaptiveRefinement(parser.isSet(adaptiveOption));
+
+    if (parser.isSet(instancesOption)) {
+        uint count;
+        if (!parseUint(parser.value(instancesOption), count, 1, INT_MAX)) {
+            err << "Invalid --instances value" << Qt::endl;
+            return 1;
+        }
+        renderer.setInstances(instanceLattice(count));
+    }
+
+    uint samples;
+    if (!parseUint(parser.value(samplesOption), samples, 1, UINT16_MAX)) {
+        err << "Invalid --samples value" << Qt::endl;
+        return 1;
+    }
+
+    if (parser.isSet(exportOption)) {
+        const auto path = parser.value(exportOption);
+        QString    error;
+        bool       completed = false;
+        QObject::connect(
+            &renderer, &Renderer::exportProgressed, &renderer,
+            [&](quint64, uint rowsWritten) {
+                err << QString("\rExported %1 of %2 rows")
+                           .arg(rowsWritten)
+                           .arg(params.height)
+                    << Qt::flush;
+            },
+            Qt::DirectConnection
+        );
+        QObject::connect(
+            &renderer, &Renderer::exportCompleted, &renderer,
+            [&]() { completed = true; }, Qt::DirectConnection
+        );
+        QObject::connect(
+            &renderer, &Renderer::exportFailed, &renderer,
+            [&](quint64, const QString &message) { error = message; },
+            Qt::DirectConnection
+        );
+
+        QElapsedTimer timer;
+        timer.start();
+        renderer.exportImage(params, path, 0);
+        const qint64 elapsedNs = timer.nsecsElapsed();
+        err << Qt::endl;
+        if (!completed) {
+            err << "Could not export " << path << ": " << error << Qt::endl;
+            return 1;
+        }
+        out << QString("Export time: %1 ms").arg(elapsedNs / 1e6, 0, 'f', 3)
+            << Qt::endl;
+        return 0;
+    }
+
+    quint64      raysTraced  = 0;
+    uint         lastSamples = 1;
+    StatsHistory history{INT_MAX};
+    QObject::connect(
+        &renderer, &Renderer::renderCompleted, &renderer,
+        [&](const RenderStats &stats) {
+            raysTraced  += stats.raysTraced;
+            lastSamples  = stats.samples;
+            history.append(stats);
+            out << QString(stats) << Qt::endl;
+        },
+        Qt::DirectConnection
+    );
+
+    renderer.frames().resize(params.width, params.height);
+
+    const bool refine = parser.isSet(refineOption);
+
+    QElapsedTimer timer;
+    timer.start();
+    forever {
+        renderer.renderEllipsoid(params, 0);
+        renderer.frames().swap();
+        if (!refine || params.pixelGranularity == 1)
+            break;
+        params.pixelGranularity /= 2;
+    }
+    while (params.pixelGranularity == 1 && 0 < lastSamples
+           && lastSamples < samples) {
+        renderer.supersample(params, 0);
+        renderer.frames().swap();
+    }
+    const qint64 elapsedNs = timer.nsecsElapsed();
+
+    const double pixels = (double)params.width * params.height;
+    out << QString("Wall time: %1 ms").arg(elapsedNs / 1e6, 0, 'f', 3)
+        << Qt::endl;
+    out << "Rays traced: " << raysTraced << Qt::endl;
+    out << "Specular table error: " << renderer.specularTableError()
+        << Qt::endl;
+    out << QString("Throughput: %1 Mpixel/s")
+               .arg(pixels / (elapsedNs / 1e3), 0, 'f', 2)
+        << Qt::endl;
+
+    const auto summary = history.summary();
+    out << QString("Workers busy: %1%")
+               .arg(summary.busyFraction * 100, 0, 'f', 1)
+        << Qt::endl;
+    out << QString("Pixel writes: %1% of busy time")
+               .arg(summary.writeFraction * 100, 0, 'f', 1)
+        << Qt::endl;
+    if (parser.isSet(statsOption)) {
+        const auto path = parser.value(statsOption);
+        if (!history.save(path)) {
+            err << "Could not save " << path << Qt::endl;
+            return 1;
+        }
+    }
+
+    if (parser.isSet(outputOption)) {
+        // Rows are stored bottom-up, as OpenGL expects them
+        const auto &frame = renderer.frames().front();
+        const QImage image{
+            frame.constData(), (int)frame.width(), (int)frame.height(),
+            (qsizetype)frame.stride() * COLOR_CHANNELS,
+            PIXEL_BUFFER_TRAITS.imageFormat
+        };
+        const auto path = parser.value(outputOption);
+        const auto rgb =
+            image.mirrored().convertToFormat(QImage::Format_RGB888);
+        if (!rgb.save(path)) {
+            err << "Could not save " << path << Qt::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
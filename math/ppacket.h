@@ -0,0 +1,300 @@
+#ifndef PPACKET_H
+#define PPACKET_H
+
+#include <cmath>
+#include <cstdint>
+
+#include "../helpers.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PPACKET_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)                                     \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PPACKET_SSE2
+#endif
+
+struct PMask;
+
+/// Fixed-width bundle of floats processed in lock-step. Lane count depends on
+/// the instruction set the translation unit is compiled for: 8 with AVX2, 4
+/// with SSE2 and 4 in the portable fallback.
+struct PPacket {
+#if defined(PPACKET_AVX2)
+    static constexpr uint WIDTH = 8;
+    typedef __m256        Native;
+#elif defined(PPACKET_SSE2)
+    static constexpr uint WIDTH = 4;
+    typedef __m128        Native;
+#else
+    static constexpr uint WIDTH = 4;
+    struct Native {
+        float lanes[WIDTH];
+    };
+#endif
+
+    Native v;
+
+    inline PPacket() = default;
+    inline PPacket(Native native) : v{native} {}
+    inline PPacket(float scalar) { *this = broadcast(scalar); }
+
+    inline static PPacket broadcast(float scalar) {
+#if defined(PPACKET_AVX2)
+        return _mm256_set1_ps(scalar);
+#elif defined(PPACKET_SSE2)
+        return _mm_set1_ps(scalar);
+#else
+        PPacket res;
+        for (uint i = 0; i < WIDTH; i++)
+            res.v.lanes[i] = scalar;
+        return res;
+#endif
+    }
+
+    /// {start, start + step, start + 2 * step, ...}
+    inline static PPacket ramp(float start, float step) {
+        alignas(32) float lanes[WIDTH];
+        for (uint i = 0; i < WIDTH; i++)
+            lanes[i] = start + step * i;
+        return load(lanes);
+    }
+
+    inline static PPacket load(const float *src) {
+#if defined(PPACKET_AVX2)
+        return _mm256_loadu_ps(src);
+#elif defined(PPACKET_SSE2)
+        return _mm_loadu_ps(src);
+#else
+        PPacket res;
+        for (uint i = 0; i < WIDTH; i++)
+            res.v.lanes[i] = src[i];
+        return res;
+#endif
+    }
+
+    inline void store(float *dst) const {
+#if defined(PPACKET_AVX2)
+        _mm256_storeu_ps(dst, v);
+#elif defined(PPACKET_SSE2)
+        _mm_storeu_ps(dst, v);
+#else
+        for (uint i = 0; i < WIDTH; i++)
+            dst[i] = v.lanes[i];
+#endif
+    }
+
+    inline PPacket operator-() const;
+
+    inline PPacket sqrt() const;
+    inline PPacket min(const PPacket &right) const;
+    inline PPacket max(const PPacket &right) const;
+    inline PPacket clamp(float min, float max) const {
+        return this->max(min).min(max);
+    }
+
+    /// Lane-wise pInvSqrt, bit-compatible with the scalar approximation.
+    inline PPacket invSqrt() const;
+
+    /// Applies a scalar function to every lane.
+    template <typename F> inline PPacket map(F function) const {
+        alignas(32) float lanes[WIDTH];
+        store(lanes);
+        for (uint i = 0; i < WIDTH; i++)
+            lanes[i] = function(lanes[i]);
+        return load(lanes);
+    }
+};
+
+// Free functions so that floats broadcast implicitly on either side
+inline PPacket operator+(const PPacket &left, const PPacket &right);
+inline PPacket operator-(const PPacket &left, const PPacket &right);
+inline PPacket operator*(const PPacket &left, const PPacket &right);
+inline PPacket operator/(const PPacket &left, const PPacket &right);
+
+inline PMask operator<(const PPacket &left, const PPacket &right);
+inline PMask operator>=(const PPacket &left, const PPacket &right);
+inline PMask operator!=(const PPacket &left, const PPacket &right);
+
+inline PPacket PPacket::operator-() const { return 0.f - *this; }
+
+struct PMask {
+    PPacket::Native v;
+
+    /// true if at least one lane is set
+    inline bool any() const;
+
+    inline PMask operator&(const PMask &right) const;
+
+    /// picks 'ifSet' in set lanes and 'ifClear' elsewhere
+    inline PPacket select(const PPacket &ifSet, const PPacket &ifClear) const;
+};
+
+#if defined(PPACKET_AVX2)
+
+inline PPacket operator+(const PPacket &left, const PPacket &right) {
+    return _mm256_add_ps(left.v, right.v);
+}
+inline PPacket operator-(const PPacket &left, const PPacket &right) {
+    return _mm256_sub_ps(left.v, right.v);
+}
+inline PPacket operator*(const PPacket &left, const PPacket &right) {
+    return _mm256_mul_ps(left.v, right.v);
+}
+inline PPacket operator/(const PPacket &left, const PPacket &right) {
+    return _mm256_div_ps(left.v, right.v);
+}
+inline PMask operator<(const PPacket &left, const PPacket &right) {
+    return {_mm256_cmp_ps(left.v, right.v, _CMP_LT_OQ)};
+}
+inline PMask operator>=(const PPacket &left, const PPacket &right) {
+    return {_mm256_cmp_ps(left.v, right.v, _CMP_GE_OQ)};
+}
+inline PMask operator!=(const PPacket &left, const PPacket &right) {
+    return {_mm256_cmp_ps(left.v, right.v, _CMP_NEQ_UQ)};
+}
+inline PPacket PPacket::sqrt() const { return _mm256_sqrt_ps(v); }
+inline PPacket PPacket::min(const PPacket &right) const {
+    return _mm256_min_ps(v, right.v);
+}
+inline PPacket PPacket::max(const PPacket &right) const {
+    return _mm256_max_ps(v, right.v);
+}
+inline PPacket PPacket::invSqrt() const {
+    const auto bits = _mm256_sub_epi32(
+        _mm256_set1_epi32(0x5F1FFFF9),
+        _mm256_srai_epi32(_mm256_castps_si256(v), 1)
+    );
+    const PPacket f = _mm256_castsi256_ps(bits);
+    return f * 0.703952253f * (PPacket{2.38924456f} - (*this * f * f));
+}
+
+inline bool PMask::any() const { return _mm256_movemask_ps(v) != 0; }
+inline PMask PMask::operator&(const PMask &right) const {
+    return {_mm256_and_ps(v, right.v)};
+}
+inline PPacket
+PMask::select(const PPacket &ifSet, const PPacket &ifClear) const {
+    return _mm256_blendv_ps(ifClear.v, ifSet.v, v);
+}
+
+#elif defined(PPACKET_SSE2)
+
+inline PPacket operator+(const PPacket &left, const PPacket &right) {
+    return _mm_add_ps(left.v, right.v);
+}
+inline PPacket operator-(const PPacket &left, const PPacket &right) {
+    return _mm_sub_ps(left.v, right.v);
+}
+inline PPacket operator*(const PPacket &left, const PPacket &right) {
+    return _mm_mul_ps(left.v, right.v);
+}
+inline PPacket operator/(const PPacket &left, const PPacket &right) {
+    return _mm_div_ps(left.v, right.v);
+}
+inline PMask operator<(const PPacket &left, const PPacket &right) {
+    return {_mm_cmplt_ps(left.v, right.v)};
+}
+inline PMask operator>=(const PPacket &left, const PPacket &right) {
+    return {_mm_cmpge_ps(left.v, right.v)};
+}
+inline PMask operator!=(const PPacket &left, const PPacket &right) {
+    return {_mm_cmpneq_ps(left.v, right.v)};
+}
+inline PPacket PPacket::sqrt() const { return _mm_sqrt_ps(v); }
+inline PPacket PPacket::min(const PPacket &right) const {
+    return _mm_min_ps(v, right.v);
+}
+inline PPacket PPacket::max(const PPacket &right) const {
+    return _mm_max_ps(v, right.v);
+}
+inline PPacket PPacket::invSqrt() const {
+    const auto bits = _mm_sub_epi32(
+        _mm_set1_epi32(0x5F1FFFF9), _mm_srai_epi32(_mm_castps_si128(v), 1)
+    );
+    const PPacket f = _mm_castsi128_ps(bits);
+    return f * 0.703952253f * (PPacket{2.38924456f} - (*this * f * f));
+}
+
+inline bool PMask::any() const { return _mm_movemask_ps(v) != 0; }
+inline PMask PMask::operator&(const PMask &right) const {
+    return {_mm_and_ps(v, right.v)};
+}
+inline PPacket
+PMask::select(const PPacket &ifSet, const PPacket &ifClear) const {
+    return _mm_or_ps(_mm_and_ps(v, ifSet.v), _mm_andnot_ps(v, ifClear.v));
+}
+
+#else
+
+// Portable fallback: masks store 0 or 1 per lane
+
+#define PPACKET_LANEWISE(expression)                                           \
+    PPacket res;                                                               \
+    for (uint i = 0; i < PPacket::WIDTH; i++)                                  \
+        res.v.lanes[i] = (expression);                                         \
+    return res;
+
+#define PMASK_LANEWISE(expression)                                             \
+    PMask res;                                                                 \
+    for (uint i = 0; i < PPacket::WIDTH; i++)                                  \
+        res.v.lanes[i] = (expression) ? 1.f : 0.f;                             \
+    return res;
+
+inline PPacket operator+(const PPacket &left, const PPacket &right) {
+    PPACKET_LANEWISE(left.v.lanes[i] + right.v.lanes[i]);
+}
+inline PPacket operator-(const PPacket &left, const PPacket &right) {
+    PPACKET_LANEWISE(left.v.lanes[i] - right.v.lanes[i]);
+}
+inline PPacket operator*(const PPacket &left, const PPacket &right) {
+    PPACKET_LANEWISE(left.v.lanes[i] * right.v.lanes[i]);
+}
+inline PPacket operator/(const PPacket &left, const PPacket &right) {
+    PPACKET_LANEWISE(left.v.lanes[i] / right.v.lanes[i]);
+}
+inline PMask operator<(const PPacket &left, const PPacket &right) {
+    PMASK_LANEWISE(left.v.lanes[i] < right.v.lanes[i]);
+}
+inline PMask operator>=(const PPacket &left, const PPacket &right) {
+    PMASK_LANEWISE(left.v.lanes[i] >= right.v.lanes[i]);
+}
+inline PMask operator!=(const PPacket &left, const PPacket &right) {
+    PMASK_LANEWISE(left.v.lanes[i] != right.v.lanes[i]);
+}
+inline PPacket PPacket::sqrt() const { PPACKET_LANEWISE(sqrtf(v.lanes[i])); }
+inline PPacket PPacket::min(const PPacket &right) const {
+    PPACKET_LANEWISE(qMin(v.lanes[i], right.v.lanes[i]));
+}
+inline PPacket PPacket::max(const PPacket &right) const {
+    PPACKET_LANEWISE(qMax(v.lanes[i], right.v.lanes[i]));
+}
+inline PPacket PPacket::invSqrt() const {
+    PPACKET_LANEWISE(pInvSqrt(v.lanes[i]));
+}
+
+inline bool PMask::any() const {
+    for (uint i = 0; i < PPacket::WIDTH; i++)
+        if (v.lanes[i] != 0.f)
+            return true;
+    return false;
+}
+inline PMask PMask::operator&(const PMask &right) const {
+    PMASK_LANEWISE(v.lanes[i] != 0.f && right.v.lanes[i] != 0.f);
+}
+inline PPacket
+PMask::select(const PPacket &ifSet, const PPacket &ifClear) const {
+    PPacket res;
+    for (uint i = 0; i < PPacket::WIDTH; i++)
+        res.v.lanes[i] = v.lanes[i] != 0.f ? ifSet.v.lanes[i]
+                                           : ifClear.v.lanes[i];
+    return res;
+}
+
+#undef PMASK_LANEWISE
+#undef PPACKET_LANEWISE
+
+#endif
+
+#endif // PPACKET_H
@@ -2,6 +2,7 @@
 #define PMATH_H
 
 #include "math/pmat4.h"
+#include "math/ppacket.h"
 #include "math/pquat.h"
 #include "math/pvec4.h"
 